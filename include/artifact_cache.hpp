@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Bumped whenever the output of opt or compile changes for the same input and configuration
+#define VTIL_UTILS_CACHE_VERSION "vtil-utils-1"
+
+// Incremental SHA-256, used to derive content addressed cache keys
+class sha256
+{
+	uint32_t state[8];
+	uint8_t buffer[64];
+	uint64_t length = 0;
+	size_t used = 0;
+
+	void transform(const uint8_t* block);
+
+public:
+	sha256();
+
+	sha256& update(const void* data, size_t size);
+	sha256& update(const std::string& data) { return update(data.data(), data.size()); }
+
+	// Returns the lowercase hexadecimal digest, the hasher cannot be updated afterwards
+	std::string hex_digest();
+};
+
+// On-disk cache of build artifacts addressed by a hash of everything that went into them. Entries are
+// written atomically so several processes may share a directory, and the least recently used entries are
+// evicted once the total size exceeds the limit.
+class artifact_cache
+{
+	std::filesystem::path root;
+	uint64_t max_bytes;
+
+	std::mutex lock;
+	uint64_t total_bytes = 0;
+
+	std::filesystem::path entry_path(const std::string& key) const;
+	void evict();
+
+public:
+	std::atomic<size_t> hits = 0;
+	std::atomic<size_t> misses = 0;
+	std::atomic<size_t> stores = 0;
+	std::atomic<size_t> evictions = 0;
+
+	artifact_cache(const std::filesystem::path& root, uint64_t max_bytes);
+
+	// Derives a key from the input bytes, the configuration and the tool version
+	static std::string make_key(const std::vector<uint8_t>& input, const std::string& config);
+
+	std::optional<std::vector<uint8_t>> get(const std::string& key);
+	void put(const std::string& key, const std::vector<uint8_t>& data);
+
+	// Logs the hit/miss statistics of this run
+	void report() const;
+};
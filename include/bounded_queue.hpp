@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Multi-producer multi-consumer queue with a fixed capacity, producers block while it is full so a fast
+// stage cannot run arbitrarily far ahead of a slow one
+template<typename T>
+class bounded_queue
+{
+	std::mutex lock;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+
+public:
+	// Depth is sampled on every push, wait times are summed over every blocked call
+	struct statistics
+	{
+		size_t pushes = 0;
+		size_t max_depth = 0;
+		double depth_sum = 0;
+		double push_wait_milliseconds = 0;
+		double pop_wait_milliseconds = 0;
+
+		double mean_depth() const { return pushes ? depth_sum / pushes : 0; }
+	};
+
+private:
+	statistics stats;
+
+	static double elapsed_ms(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+	}
+
+public:
+	explicit bounded_queue(size_t capacity)
+		: capacity(std::max<size_t>(capacity, 1))
+	{
+	}
+
+	// Blocks while the queue is full, items pushed after close are dropped
+	void push(T item)
+	{
+		std::unique_lock _g(lock);
+		if (items.size() >= capacity && !closed)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+			not_full.wait(_g, [&] { return items.size() < capacity || closed; });
+			stats.push_wait_milliseconds += elapsed_ms(t0);
+		}
+		if (closed)
+			return;
+
+		items.push_back(std::move(item));
+		stats.pushes++;
+		stats.depth_sum += items.size();
+		stats.max_depth = std::max(stats.max_depth, items.size());
+		not_empty.notify_one();
+	}
+
+	// Blocks while the queue is empty, returns nullopt once it is closed and drained
+	std::optional<T> pop()
+	{
+		std::unique_lock _g(lock);
+		if (items.empty() && !closed)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+			not_empty.wait(_g, [&] { return !items.empty() || closed; });
+			stats.pop_wait_milliseconds += elapsed_ms(t0);
+		}
+		if (items.empty())
+			return std::nullopt;
+
+		T item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return item;
+	}
+
+	// No more items will be pushed, consumers drain what is left
+	void close()
+	{
+		std::lock_guard _g(lock);
+		closed = true;
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+
+	statistics get_statistics()
+	{
+		std::lock_guard _g(lock);
+		return stats;
+	}
+};
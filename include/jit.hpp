@@ -0,0 +1,60 @@
+#pragma once
+
+#include <asmjit/x86.h>
+#include <vtil/arch>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Default image base the compiled code assumes for image-relative addressing
+constexpr uint64_t default_jit_image_base = 0x180'000'000;
+
+// Error handler that turns AsmJit errors into exceptions
+class jit_error_handler : public asmjit::ErrorHandler
+{
+public:
+	void handleError(asmjit::Error err, const char* message, asmjit::BaseEmitter* origin) override
+	{
+		throw std::runtime_error(std::string("AsmJit error: ") + message);
+	}
+};
+
+// Compiles the routine into a single `void()` function in the given code holder, which must already be
+// initialized for the target environment
+void compile_routine(vtil::routine* rtn, asmjit::CodeHolder& code);
+
+// Whether compile_routine has a handler for the instruction
+bool can_compile(const vtil::instruction_desc& desc);
+
+// Compiles the routine with a compiler that is already attached to an initialized code holder
+void compile_routine(vtil::routine* rtn, asmjit::x86::Compiler& cc);
+
+// Whether compile_routine runs the peephole pass over the selected instructions before register allocation
+extern std::atomic<bool> peephole_enabled;
+
+// Whether compile_routine allocates 32-bit registers where they suffice and operates on the 8, 16 and
+// 32-bit views operands select. Disabled, every register is 64 bits wide and any narrower operand is
+// extracted into and merged back from a scratch register, the lowering before width-correct code
+// generation, which is kept to measure the code size it saves.
+extern std::atomic<bool> narrow_registers_enabled;
+
+// Logs how often each peephole rule fired since the process started
+void report_peephole();
+
+// Reusable compilation state, meant to be owned by a single thread. The code holder and the compiler's
+// zone memory are reset between routines instead of being rebuilt.
+struct jit_context
+{
+	asmjit::Environment environment;
+	asmjit::CodeHolder code;
+	asmjit::x86::Compiler cc;
+	jit_error_handler error_handler;
+	asmjit::Logger* logger = nullptr;
+
+	explicit jit_context(const asmjit::Environment& environment);
+
+	// Compiles the routine and returns the bytes of the text section
+	std::vector<uint8_t> compile(vtil::routine* rtn);
+};
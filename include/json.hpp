@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimal JSON document model used for seeds, reports and requests
+namespace json
+{
+struct value
+{
+	enum class kind
+	{
+		null,
+		boolean,
+		number,
+		string,
+		array,
+		object,
+	};
+
+	kind type = kind::null;
+	bool boolean = false;
+
+	// Numbers keep their literal text so 64-bit integers survive a round trip
+	std::string text;
+	std::vector<value> items;
+	std::vector<std::pair<std::string, value>> members;
+
+	value() = default;
+	value(std::nullptr_t) {}
+	value(bool b)
+		: type(kind::boolean)
+		, boolean(b) {}
+	value(const char* s)
+		: type(kind::string)
+		, text(s) {}
+	value(std::string s)
+		: type(kind::string)
+		, text(std::move(s)) {}
+	value(double d);
+	value(int64_t i);
+	value(uint64_t u);
+	value(int i)
+		: value(int64_t(i)) {}
+	value(unsigned u)
+		: value(uint64_t(u)) {}
+#if defined(__APPLE__)
+	value(size_t u)
+		: value(uint64_t(u)) {}
+#endif
+
+	static value array() { return with_type(kind::array); }
+	static value object() { return with_type(kind::object); }
+
+	bool is_null() const { return type == kind::null; }
+	bool is_number() const { return type == kind::number; }
+	bool is_string() const { return type == kind::string; }
+	bool is_array() const { return type == kind::array; }
+	bool is_object() const { return type == kind::object; }
+
+	// Member lookup, returns nullptr if missing or not an object
+	const value* find(const std::string& key) const;
+	value& operator[](const std::string& key);
+
+	value& push_back(value v);
+
+	double as_double() const;
+
+	// Accepts numbers and strings holding decimal or 0x-prefixed hexadecimal integers
+	uint64_t as_u64() const;
+	const std::string& as_string() const;
+
+	std::string dump(bool pretty = false) const;
+
+private:
+	static value with_type(kind k)
+	{
+		value v;
+		v.type = k;
+		return v;
+	}
+	void dump(std::string& out, bool pretty, int depth) const;
+};
+
+// Throws std::runtime_error on malformed input
+value parse(const std::string& text);
+} // namespace json
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "mapped_file.hpp"
+#include "pe_input.hpp"
+#include "lift_cache.hpp"
+
+#include <lifters/core>
+#include <lifters/amd64>
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Instructions are lifted through the process-wide lift cache, see lift_cache.hpp
+using amd64_lifter = memoizing_lifter<vtil::lifter::amd64::lifter_t>;
+using amd64_recursive_descent = vtil::lifter::recursive_descent<pe_input, amd64_lifter>;
+
+// 64-bit PE file mapped into memory together with the views the lifter reads through
+struct loaded_pe
+{
+	mapped_file file;
+	std::optional<vtil::pe_image> image;
+	std::optional<pe_input> input;
+
+	explicit loaded_pe(const std::filesystem::path& path);
+	loaded_pe(const loaded_pe&) = delete;
+	loaded_pe& operator=(const loaded_pe&) = delete;
+
+	bool contains(uint64_t address) const;
+};
+
+// Lifts the function at the given virtual address, the routine uses the default amd64 calling convention
+vtil::routine* lift_function(pe_input& input, uint64_t address);
+
+// Limits on the exploration of a single function, zero means unlimited. Blocks and instructions count
+// what has been lifted, the timeout runs from the start of the exploration.
+struct lift_budget
+{
+	size_t max_blocks = 0;
+	size_t max_instructions = 0;
+	std::chrono::milliseconds timeout{ 0 };
+
+	bool unlimited() const { return !max_blocks && !max_instructions && timeout.count() == 0; }
+};
+
+struct explore_options
+{
+	// Threads exploring the function, discovered branch targets are shared between them
+	size_t jobs = 1;
+	lift_budget budget;
+};
+
+// Edge the exploration did not follow, the target block only holds a `vexit` to the target address
+struct unexplored_edge
+{
+	uint64_t source;
+	uint64_t target;
+};
+
+struct explored_function
+{
+	vtil::routine* rtn;
+	std::vector<unexplored_edge> unexplored;
+
+	// Name of the budget that ran out, or nullptr if the function was explored completely
+	const char* exhausted = nullptr;
+};
+
+// Like lift_function, but explores on several threads and stops at the budget. The routine is valid
+// either way, edges that were cut off leave the routine through `vexit`.
+explored_function explore_function(pe_input& input, uint64_t address, const explore_options& options);
+
+// Writes the unexplored edges as one `0x<source block> -> 0x<target>` line each
+void save_unexplored(const std::vector<unexplored_edge>& edges, const std::filesystem::path& path);
+
+// Function entries described by the exception directory (.pdata), chained unwind entries describe
+// parts of another function and are skipped
+std::vector<uint64_t> enum_pdata_functions(const pe_input& input);
+
+// Executable exports, forwarded and data exports are skipped
+std::vector<std::pair<uint64_t, std::string>> enum_exports(const pe_input& input);
+
+// File name for a lifted function, either its sanitized symbol name or sub_<address>
+std::string function_file_name(uint64_t address, const std::string& name);
+
+// File names for functions keyed by address, in address order. Distinct symbols can sanitize to the same
+// name, e.g. decorated C++ names differing only in ?, @ or $, so names that collide, compared case
+// insensitively, get _<address> appended.
+std::vector<std::string> function_file_names(const std::map<uint64_t, std::string>& functions);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vtil/arch>
+
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// VTIL instructions a single machine instruction lifted to. Stack state is stored relative to the block
+// state the instruction was lifted at, so the sequence can be replayed anywhere.
+struct lifted_sequence
+{
+	struct entry
+	{
+		vtil::instruction instruction;
+		int64_t sp_offset;
+		uint32_t sp_index;
+	};
+
+	std::vector<entry> instructions;
+	int64_t sp_offset_delta;
+	uint32_t sp_index_delta;
+};
+
+// Process-wide memo of lifted instructions keyed by their raw bytes. Machine code protected by virtual
+// machines repeats the same handlers many times, so most instructions only have to be disassembled and
+// lifted once. Instructions whose lifted form depends on their address, such as branches, calls and
+// rip-relative accesses, are never cached.
+class lift_cache
+{
+	using lift_fn = size_t (*)(vtil::basic_block* block, uint64_t vip, uint8_t* code);
+
+	static constexpr size_t max_instruction_length = 15;
+	static constexpr size_t max_entries = 1 << 20;
+
+	mutable std::shared_mutex lock;
+	std::unordered_map<std::string, std::shared_ptr<const lifted_sequence>> entries;
+
+	// Bit n is set once an instruction of length n has been cached
+	std::atomic<uint32_t> lengths = 0;
+
+	std::shared_ptr<const lifted_sequence> find(const uint8_t* code, size_t& length) const;
+	void replay(vtil::basic_block* block, uint64_t vip, const lifted_sequence& sequence) const;
+	std::shared_ptr<const lifted_sequence> capture(vtil::basic_block* block, uint64_t vip, size_t count, int64_t sp_offset, uint32_t sp_index) const;
+
+public:
+	std::atomic<bool> enabled = true;
+	std::atomic<size_t> hits = 0;
+	std::atomic<size_t> misses = 0;
+	std::atomic<size_t> uncacheable = 0;
+
+	static lift_cache& instance();
+
+	// Lifts the instruction at code into the block, either from the cache or through fn
+	size_t lift(vtil::basic_block* block, uint64_t vip, uint8_t* code, lift_fn fn);
+
+	void clear();
+
+	// Logs the hit/miss statistics
+	void report() const;
+};
+
+// Drop-in replacement for a NativeLifters architecture lifter that goes through the lift cache
+template<typename Lifter>
+struct memoizing_lifter : Lifter
+{
+	static size_t process(vtil::basic_block* block, uint64_t vip, uint8_t* code)
+	{
+		return lift_cache::instance().lift(block, vip, code, &Lifter::process);
+	}
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// Read-only view of a whole file mapped into memory
+class mapped_file
+{
+	const uint8_t* base = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+#endif
+
+	void close();
+
+public:
+	mapped_file() = default;
+	explicit mapped_file(const std::filesystem::path& path);
+	~mapped_file();
+
+	mapped_file(mapped_file&& other) noexcept;
+	mapped_file& operator=(mapped_file&& other) noexcept;
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	const uint8_t* data() const { return base; }
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <vtil/arch>
+
+#include <string>
+#include <vector>
+
+// Optimizer pass that can be scheduled by name, returns the number of changes it made
+struct opt_pass
+{
+	const char* name;
+	size_t (*run)(vtil::routine* rtn);
+};
+
+// Group of passes run in order, exhaustive groups repeat until none of their passes make a change
+struct opt_step
+{
+	std::vector<const opt_pass*> passes;
+	bool exhaust = false;
+};
+
+using opt_pipeline = std::vector<opt_step>;
+
+// Every optimizer pass exported by VTIL-Core
+const std::vector<opt_pass>& opt_passes();
+
+// Returns nullptr if there is no pass with the given name
+const opt_pass* find_opt_pass(const std::string& name);
+
+// Same pass order as optimizer::apply_all, spelled out so every pass can be observed individually
+const opt_pipeline& default_pipeline();
+
+// Preset pipelines, 0 runs nothing, 1 runs the cheap local passes once and 2 is the default pipeline
+const opt_pipeline& preset_pipeline(int level);
+
+// Parses a comma separated list of pass names, passes inside brackets are repeated until none of them
+// make a change, e.g. "stack_pinning,[mov_propagation,fast_dead_code_elimination],branch_correction"
+opt_pipeline parse_pipeline(const std::string& spec);
+
+// Inverse of parse_pipeline
+std::string describe_pipeline(const opt_pipeline& pipeline);
+
+// Wall-clock limits in milliseconds, zero means unlimited. Budgets are cooperative: a running pass is never
+// preempted, the deadlines are checked between passes and between iterations of repeating groups. A pass
+// that overruns its budget is not scheduled again for that routine, and once the routine budget is spent
+// the routine is kept as optimized so far, so a routine overruns by at most the pass running at the time.
+struct opt_budget
+{
+	double routine_milliseconds = 0;
+	double pass_milliseconds = 0;
+};
+
+// Statistics of a single pass over one routine, accumulated over every time the pass ran
+struct pass_profile
+{
+	std::string pass;
+	size_t iterations = 0;
+	size_t changes = 0;
+	double milliseconds = 0;
+	size_t instructions_before = 0;
+	size_t instructions_after = 0;
+	size_t blocks_before = 0;
+	size_t blocks_after = 0;
+	bool budget_exceeded = false;
+};
+
+struct routine_profile
+{
+	std::string routine;
+	double milliseconds = 0;
+	size_t instructions_before = 0;
+	size_t instructions_after = 0;
+	size_t blocks_before = 0;
+	size_t blocks_after = 0;
+	bool budget_exceeded = false;
+	std::vector<pass_profile> passes;
+};
+
+// Runs the pipeline over the routine, filling in the profile if one is given. Returns false if a budget
+// cut the pipeline short.
+bool run_pipeline(vtil::routine* rtn, const opt_pipeline& pipeline, const opt_budget& budget = {}, routine_profile* profile = nullptr);
+
+// Merges routine profiles into a single report with per routine details and per pass totals
+json::value profile_report(const std::vector<routine_profile>& profiles);
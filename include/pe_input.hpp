@@ -2,25 +2,142 @@
 
 #include <vtil/arch>
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Returns the DOS/NT headers and the section table of a raw image, which is everything pe_image needs to
+// describe the layout. Section contents are read from the raw image directly through pe_input.
+inline std::vector<uint8_t> pe_header_bytes(const uint8_t* raw, size_t raw_size)
+{
+	auto read_u16 = [&](size_t offset) -> uint16_t {
+		return offset + 2 <= raw_size ? uint16_t(raw[offset] | (raw[offset + 1] << 8)) : 0;
+	};
+	auto read_u32 = [&](size_t offset) -> uint32_t {
+		return offset + 4 <= raw_size ? uint32_t(read_u16(offset) | (uint32_t(read_u16(offset + 2)) << 16)) : 0;
+	};
+
+	size_t nt_offset = read_u32(0x3C);
+	size_t optional_offset = nt_offset + 0x18;
+	size_t section_table = optional_offset + read_u16(nt_offset + 0x14);
+	size_t header_end = section_table + read_u16(nt_offset + 0x6) * size_t(0x28);
+
+	// Keep SizeOfHeaders worth of data if it is larger than the table itself
+	header_end = std::max<size_t>(header_end, read_u32(optional_offset + 0x3C));
+	header_end = std::min(header_end, raw_size);
+	return { raw, raw + header_end };
+}
+
 struct pe_input
 {
-	vtil::pe_image& img;
+	// Range of RVAs backed by the raw image
+	struct section_range
+	{
+		uint64_t begin;
+		uint64_t end;
+		const uint8_t* data;
+		bool executable;
+	};
+
+	const vtil::pe_image& img;
+	const uint8_t* raw;
+	size_t raw_size;
+	uint64_t image_base;
+	std::vector<section_range> ranges;
+
+	pe_input(const vtil::pe_image& img, const uint8_t* raw, size_t raw_size)
+		: img(img)
+		, raw(raw)
+		, raw_size(raw_size)
+		, image_base(img.get_image_base())
+	{
+		// The headers are mapped at RVA 0 and are as large as the first raw section offset
+		uint64_t header_size = raw_size;
+		uint64_t section_table = read_raw_u32(0x3C) + 0x18 + read_raw_u16(read_raw_u32(0x3C) + 0x14);
+		for (size_t i = 0; i < img.get_section_count(); i++)
+		{
+			constexpr uint32_t scn_mem_execute = 0x20000000;
+			bool executable = read_raw_u32(section_table + i * 0x28 + 0x24) & scn_mem_execute;
 
-	pe_input(vtil::pe_image& img)
-		: img(img) {}
+			auto section = img.get_section(i);
+			if (section.physical_size == 0 || section.physical_address >= raw_size)
+				continue;
+			header_size = std::min<uint64_t>(header_size, section.physical_address);
+
+			// Bytes past the raw size are zero-filled by the loader and are not part of the file
+			uint64_t size = std::min<uint64_t>({ section.virtual_size ? section.virtual_size : section.physical_size,
+				section.physical_size,
+				raw_size - section.physical_address });
+			ranges.push_back({ section.virtual_address, section.virtual_address + size, raw + section.physical_address, executable });
+		}
+		ranges.push_back({ 0, header_size, raw, false });
+
+		std::sort(ranges.begin(), ranges.end(), [](const section_range& a, const section_range& b) {
+			return a.begin < b.begin;
+		});
+	}
+
+	uint16_t read_raw_u16(size_t offset) const
+	{
+		return offset + 2 <= raw_size ? uint16_t(raw[offset] | (raw[offset + 1] << 8)) : 0;
+	}
+
+	uint32_t read_raw_u32(size_t offset) const
+	{
+		return offset + 4 <= raw_size ? uint32_t(read_raw_u16(offset) | (uint32_t(read_raw_u16(offset + 2)) << 16)) : 0;
+	}
+
+	// Reads a value at the given RVA, returns zero if it is not backed by the image
+	template<typename T>
+	T read(uint64_t rva) const
+	{
+		auto range = find_range(rva);
+		if (!range || rva + sizeof(T) > range->end)
+			return T{};
+		T value;
+		memcpy(&value, range->data + (rva - range->begin), sizeof(T));
+		return value;
+	}
+
+	// Returns the { rva, size } pair of a PE32+ optional header data directory
+	std::pair<uint32_t, uint32_t> data_directory(size_t index) const
+	{
+		size_t entry = read_raw_u32(0x3C) + 0x18 + 0x70 + index * 8;
+		return { read_raw_u32(entry), read_raw_u32(entry + 4) };
+	}
+
+	bool is_executable(uint64_t rva) const
+	{
+		auto range = find_range(rva);
+		return range && range->executable;
+	}
+
+	const section_range* find_range(uint64_t rva) const
+	{
+		auto it = std::upper_bound(ranges.begin(), ranges.end(), rva, [](uint64_t rva, const section_range& range) {
+			return rva < range.begin;
+		});
+		if (it == ranges.begin())
+			return nullptr;
+		--it;
+		return rva < it->end ? &*it : nullptr;
+	}
+
+	const uint8_t* rva_to_ptr(uint64_t rva) const
+	{
+		auto range = find_range(rva);
+		return range ? range->data + (rva - range->begin) : nullptr;
+	}
 
 	bool is_valid(vtil::vip_t vip) const
 	{
-		auto last = img.get_section_count() - 1;
-		auto ls = img.get_section(last);
-		return vip >= img.get_image_base() && vip < img.get_image_base() + ls.virtual_size + ls.virtual_address;
+		return vip >= image_base && find_range(vip - image_base) != nullptr;
 	}
 
 	uint8_t* get_at(vtil::vip_t vip) const
 	{
-		fassert(is_valid(vip));
-		auto ptr = img.rva_to_ptr(vip - img.get_image_base());
+		auto ptr = vip >= image_base ? rva_to_ptr(vip - image_base) : nullptr;
 		fassert(ptr != nullptr);
 		return (uint8_t*)ptr;
 	}
-};
\ No newline at end of file
+};
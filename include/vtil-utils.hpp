@@ -6,6 +6,7 @@
 #include <args.hxx>
 
 #include <filesystem>
+#include <functional>
 #include <vector>
 
 // Some extensions for the arguments library
@@ -53,12 +54,56 @@ using HexValueFlag = args::ValueFlag<T, HexValueReader>;
 
 template<typename T>
 using HexPositional = args::Positional<T, HexValueReader>;
+
+template<typename T>
+using HexPositionalList = args::PositionalList<T, std::vector, HexValueReader>;
 } // namespace args
 
 args::Group& commands();
 
+// Global verbosity, lowered by --quiet and raised by each -v
+enum class verbosity_level : int
+{
+	quiet = -1,
+	normal = 0,
+	verbose = 1,
+	trace = 2,
+};
+extern verbosity_level verbosity;
+
+inline bool is_verbose(verbosity_level level)
+{
+	return verbosity >= level;
+}
+
+// Whether hot path trace sites are enabled, always false in release builds so they compile out
+inline bool trace_enabled()
+{
+#ifdef NDEBUG
+	return false;
+#else
+	return verbosity >= verbosity_level::trace;
+#endif
+}
+
+// Logs a trace message, the arguments are only evaluated if tracing is enabled
+#define LOG_TRACE(...)                          \
+	do                                          \
+	{                                           \
+		if (trace_enabled())                    \
+			vtil::logger::log(__VA_ARGS__);     \
+	} while (0)
+
+// Logs a message at the given verbosity, the arguments are only formatted if it is enabled
 template<typename... Args>
-inline void fatal(const char* fmt, Args&&... args)
+inline void log_at(verbosity_level level, const char* fmt, Args&&... args)
+{
+	if (is_verbose(level))
+		vtil::logger::log(fmt, std::forward<Args>(args)...);
+}
+
+template<typename... Args>
+[[noreturn]] inline void fatal(const char* fmt, Args&&... args)
 {
 	auto str = vtil::format::str(fmt, std::forward<Args>(args)...);
 	while (!str.empty() && (str.back() == '\r' || str.back() == '\n'))
@@ -66,4 +111,33 @@ inline void fatal(const char* fmt, Args&&... args)
 	throw std::runtime_error(str);
 }
 
-std::vector<std::filesystem::path> enum_vtil_files(const std::filesystem::path& path);
\ No newline at end of file
+std::vector<std::filesystem::path> enum_vtil_files(const std::filesystem::path& path);
+
+// Reads a list file containing one path per line, relative paths are resolved against the list's directory
+std::vector<std::filesystem::path> read_list_file(const std::filesystem::path& path);
+
+// Returns the path of a batch input relative to the batch root, falling back to the bare file name
+std::filesystem::path batch_relative_path(const std::filesystem::path& file, const std::filesystem::path& root);
+
+// Appends _2, _3, ... to the stem of every path that repeats an earlier one. Paths are compared case
+// insensitively, as they may end up on a case insensitive file system.
+void disambiguate_paths(std::vector<std::filesystem::path>& paths);
+
+// batch_relative_path of every input, disambiguated so no two inputs write the same output
+std::vector<std::filesystem::path> batch_relative_paths(const std::vector<std::filesystem::path>& files, const std::filesystem::path& root);
+
+// Reads or writes a whole file at once
+std::vector<uint8_t> read_file_bytes(const std::filesystem::path& path);
+void write_file_bytes(const std::filesystem::path& path, const std::vector<uint8_t>& data);
+
+// Peak resident memory of the process so far in bytes, zero if the platform does not report it
+uint64_t peak_memory_bytes();
+
+// Current resident memory of the process in bytes, zero if the platform does not report it
+uint64_t current_memory_bytes();
+
+// Default worker count for batch commands
+size_t default_jobs();
+
+// Invokes fn(index) for every index in [0, count) on up to `jobs` threads, indices are handed out in order
+void parallel_for(size_t count, size_t jobs, const std::function<void(size_t)>& fn);
\ No newline at end of file
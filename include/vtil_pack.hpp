@@ -0,0 +1,83 @@
+#pragma once
+
+#include "mapped_file.hpp"
+
+#include <vtil/arch>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Layout of a .vtilpack file, all integers are little endian:
+//
+//   header   magic "VTILPACK", u32 version, u32 count, u64 index offset, u64 index size
+//   data     serialized routines, each exactly as it would be stored in a .vtil file
+//   index    per routine: u64 offset, u64 size, u32 blocks, u32 instructions, u8 sha256[32],
+//            u16 name length, name
+//
+constexpr char vtil_pack_magic[8] = { 'V', 'T', 'I', 'L', 'P', 'A', 'C', 'K' };
+constexpr uint32_t vtil_pack_version = 1;
+constexpr const char* vtil_pack_extension = ".vtilpack";
+
+struct pack_entry
+{
+	std::string name;
+	std::string hash;
+	uint64_t offset = 0;
+	uint64_t size = 0;
+	uint32_t blocks = 0;
+	uint32_t instructions = 0;
+};
+
+// Read-only view of a pack, routines are deserialized from the mapping on demand
+class vtil_pack
+{
+	mapped_file file;
+	std::vector<pack_entry> index;
+	std::unordered_map<std::string, size_t> by_name;
+
+public:
+	explicit vtil_pack(const std::filesystem::path& path);
+
+	const std::vector<pack_entry>& entries() const { return index; }
+
+	// Returns nullptr if there is no routine with the given name
+	const pack_entry* find(const std::string& name) const;
+
+	// Serialized bytes of the routine, pointing into the mapping
+	const uint8_t* data(const pack_entry& entry) const { return file.data() + entry.offset; }
+
+	vtil::routine* load(const pack_entry& entry) const;
+};
+
+// Routine to be stored in a pack
+struct pack_source
+{
+	std::string name;
+	std::vector<uint8_t> data;
+	uint32_t blocks = 0;
+	uint32_t instructions = 0;
+};
+
+void write_pack(const std::filesystem::path& path, const std::vector<pack_source>& routines);
+
+// Deserializes a routine from its serialized bytes
+vtil::routine* deserialize_routine(const uint8_t* data, size_t size);
+
+// Routines are referenced either by a plain .vtil path or as pack.vtilpack:name
+struct routine_ref
+{
+	std::filesystem::path file;
+	std::string name;
+
+	bool in_pack() const { return !name.empty(); }
+
+	// Name of the routine without directory or extension, used to name derived outputs
+	std::string stem() const;
+};
+
+routine_ref parse_routine_ref(const std::string& spec);
+vtil::routine* load_routine_ref(const routine_ref& ref);
+std::vector<uint8_t> read_routine_bytes(const routine_ref& ref);
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Checks the compiler against the routine corpus in examples/corpus.
+
+The corpus is described by corpus.json as `vtil gen` invocations with fixed seeds, so every build generates
+the same routines. For each case the script
+
+  * runs the compiled routines with `vtil bench-exec --verify`, with and without the peephole pass and with
+    every register lowered at 64 bits, and fails if any register differs from the symbolic emulator,
+  * measures the emitted bytes and instructions with `compile --bench`, once with width-correct code
+    generation and once with `--wide-registers`, the 64-bit-only lowering it replaced. Cases marked
+    "reduction" must come out strictly smaller, every other case must not grow,
+  * compares the width-correct figures with baseline.json when it exists.
+
+    scripts/check_corpus.py --vtil build/vtil
+    scripts/check_corpus.py --vtil build/vtil --update-baseline
+
+The baseline is only written by --update-baseline, code that grows past it fails the check.
+"""
+
+import argparse
+import json
+import re
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+CODE_SIZE = re.compile(
+    r"Code size: (\d+) bytes, (\d+) instructions without peephole, (\d+) bytes, (\d+) instructions with peephole"
+)
+
+# Compiler settings every case is verified with
+LOWERINGS = {
+    "default": [],
+    "no peephole": ["--no-peephole"],
+    "wide registers": ["--wide-registers"],
+}
+
+
+def run(vtil, *args):
+    result = subprocess.run([vtil, *map(str, args)], capture_output=True, text=True)
+    return result.returncode, result.stdout + result.stderr
+
+
+def generate(vtil, case, directory):
+    code, output = run(vtil, "gen", directory, "--count", case["count"], "--seed", case["seed"], *case["args"])
+    if code != 0:
+        sys.exit(f"vtil gen failed for {case['name']}:\n{output}")
+    return sorted(directory.glob("*.vtil"))
+
+
+def verify(vtil, directory, seed, name, flags):
+    """Returns the number of routines whose registers were checked and the failing output, if any."""
+    report = directory / f"verify-{name.replace(' ', '-')}.json"
+    args = ["bench-exec", directory, "--verify", "-n", "1", "--emu-iterations", "1", "--seed", seed, "--json", report, *flags]
+    code, output = run(vtil, *args)
+    verified = sum(1 for entry in json.loads(report.read_text()) if entry.get("verified")) if report.exists() else 0
+    return verified, output if code != 0 else None
+
+
+def code_size(vtil, routine, *flags):
+    """Bytes and instructions of the routine compiled with the peephole pass."""
+    code, output = run(vtil, "compile", routine, "--bench", 1, *flags)
+    match = CODE_SIZE.search(output)
+    if code != 0 or not match:
+        sys.exit(f"vtil compile --bench failed for {routine}:\n{output}")
+    return [int(value) for value in match.groups()[2:]]
+
+
+def total_size(vtil, routines, *flags):
+    return [sum(values) for values in zip(*(code_size(vtil, routine, *flags) for routine in routines))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--vtil", default="vtil", help="path of the vtil executable")
+    parser.add_argument("--corpus", type=Path, default=Path(__file__).resolve().parent.parent / "examples" / "corpus")
+    parser.add_argument("--update-baseline", action="store_true", help="record the current code size as the baseline")
+    options = parser.parse_args()
+
+    corpus = json.loads((options.corpus / "corpus.json").read_text())
+    seed = options.corpus / corpus["seed"]
+    baseline_path = options.corpus / "baseline.json"
+    baseline = json.loads(baseline_path.read_text()) if baseline_path.exists() else {}
+
+    failed = False
+    figures = {}
+    print("Sizes are totals over the case with the peephole pass, 64-bit lowering -> width-correct\n")
+    print(f"{'case':<24} {'routines':>8} {'verified':>8} {'bytes':>16} {'instructions':>16} {'saved':>7} {'baseline':>20}")
+    with tempfile.TemporaryDirectory() as work:
+        for case in corpus["cases"]:
+            directory = Path(work) / case["name"]
+            routines = generate(options.vtil, case, directory)
+
+            verified = None
+            for name, flags in LOWERINGS.items():
+                count, failure = verify(options.vtil, directory, seed, name, flags)
+                verified = count if verified is None else min(verified, count)
+                if failure:
+                    failed = True
+                    print(f"{case['name']}: compiled code differs from emulation ({name})\n{failure}")
+
+            wide_bytes, wide_instructions = total_size(options.vtil, routines, "--wide-registers")
+            narrow_bytes, narrow_instructions = total_size(options.vtil, routines)
+            figures[case["name"]] = {"bytes": narrow_bytes, "instructions": narrow_instructions}
+
+            saved = 100.0 * (wide_bytes - narrow_bytes) / wide_bytes if wide_bytes else 0.0
+            notes = []
+            if narrow_bytes > wide_bytes or narrow_instructions > wide_instructions:
+                notes.append("larger than the 64-bit lowering")
+            elif case.get("reduction") and (narrow_bytes >= wide_bytes or narrow_instructions >= wide_instructions):
+                notes.append("no smaller than the 64-bit lowering")
+
+            recorded = baseline.get(case["name"])
+            comparison = "-"
+            if recorded:
+                comparison = f"{recorded['bytes']} B, {recorded['instructions']} ins"
+                if not options.update_baseline and (narrow_bytes > recorded["bytes"] or narrow_instructions > recorded["instructions"]):
+                    notes.append("grew past the baseline")
+
+            print(f"{case['name']:<24} {len(routines):>8} {verified:>8} {f'{wide_bytes} -> {narrow_bytes}':>16}"
+                  f" {f'{wide_instructions} -> {narrow_instructions}':>16} {f'{saved:.1f}%':>7} {comparison:>20}")
+            for note in notes:
+                failed = True
+                print(f"{case['name']}: {note}")
+
+    if options.update_baseline:
+        baseline_path.write_text(json.dumps(figures, indent=4) + "\n")
+        print(f"\nBaseline written to {baseline_path}")
+    elif not baseline:
+        print(f"\nNo baseline in {baseline_path}, only the 64-bit lowering was compared against")
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
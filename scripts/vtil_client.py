@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Client for `vtil serve --socket`.
+
+Sends one JSON request per line, either read from stdin or given on the command line, and prints the
+responses in the order they arrive. Responses carry the "id" of their request, as requests are handled
+concurrently and may finish out of order.
+
+    vtil serve --socket /tmp/vtil.sock &
+    scripts/vtil_client.py /tmp/vtil.sock '{"id": 1, "command": "dump", "input": "test.vtil"}'
+    scripts/vtil_client.py /tmp/vtil.sock < requests.jsonl
+"""
+
+import json
+import socket
+import sys
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(f"usage: {sys.argv[0]} <socket> [request...]")
+
+    requests = sys.argv[2:] or [line for line in sys.stdin if line.strip()]
+    for request in requests:
+        json.loads(request)
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(sys.argv[1])
+        sock.sendall("".join(request.strip() + "\n" for request in requests).encode())
+
+        # A shutdown request ends the server, which answers it before closing
+        pending = len(requests)
+        failed = False
+        with sock.makefile("r") as responses:
+            for line in responses:
+                print(line, end="", flush=True)
+                failed |= not json.loads(line).get("ok", False)
+                pending -= 1
+                if pending == 0:
+                    break
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
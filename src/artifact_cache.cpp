@@ -0,0 +1,240 @@
+#include "artifact_cache.hpp"
+#include "vtil-utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+namespace fs = std::filesystem;
+
+static constexpr uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+sha256::sha256()
+	: state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 }
+{
+}
+
+void sha256::transform(const uint8_t* block)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++)
+		w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) | (uint32_t(block[i * 4 + 2]) << 8) | block[i * 4 + 3];
+	for (int i = 16; i < 64; i++)
+	{
+		uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; i++)
+	{
+		uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+sha256& sha256::update(const void* data, size_t size)
+{
+	auto bytes = (const uint8_t*)data;
+	length += size;
+	while (size)
+	{
+		size_t n = std::min(size, sizeof(buffer) - used);
+		memcpy(buffer + used, bytes, n);
+		used += n;
+		bytes += n;
+		size -= n;
+		if (used == sizeof(buffer))
+		{
+			transform(buffer);
+			used = 0;
+		}
+	}
+	return *this;
+}
+
+std::string sha256::hex_digest()
+{
+	uint64_t bits = length * 8;
+	uint8_t padding[72] = { 0x80 };
+	size_t pad = (used < 56 ? 56 : 120) - used;
+	for (int i = 0; i < 8; i++)
+		padding[pad + i] = uint8_t(bits >> (56 - i * 8));
+	update(padding, pad + 8);
+
+	std::string digest;
+	for (uint32_t word : state)
+		digest += vtil::format::str("%08x", word);
+	return digest;
+}
+
+artifact_cache::artifact_cache(const fs::path& root, uint64_t max_bytes)
+	: root(root)
+	, max_bytes(max_bytes)
+{
+	fs::create_directories(root);
+	for (const auto& entry : fs::recursive_directory_iterator(root))
+	{
+		if (entry.is_regular_file())
+			total_bytes += entry.file_size();
+	}
+}
+
+std::string artifact_cache::make_key(const std::vector<uint8_t>& input, const std::string& config)
+{
+	// Every part is length prefixed so that adjacent parts cannot alias each other
+	//
+	sha256 hasher;
+	for (const std::string& part : { std::string(VTIL_UTILS_CACHE_VERSION), config })
+	{
+		uint64_t size = part.size();
+		hasher.update(&size, sizeof(size)).update(part);
+	}
+	uint64_t size = input.size();
+	hasher.update(&size, sizeof(size)).update(input.data(), input.size());
+	return hasher.hex_digest();
+}
+
+fs::path artifact_cache::entry_path(const std::string& key) const
+{
+	return root / key.substr(0, 2) / key;
+}
+
+std::optional<std::vector<uint8_t>> artifact_cache::get(const std::string& key)
+{
+	auto path = entry_path(key);
+	std::ifstream stream(path, std::ios::binary);
+	if (!stream.is_open())
+	{
+		misses++;
+		return std::nullopt;
+	}
+	std::vector<uint8_t> data{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+	// The modification time doubles as the last access time for eviction
+	//
+	std::error_code ec;
+	fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+	hits++;
+	return data;
+}
+
+void artifact_cache::put(const std::string& key, const std::vector<uint8_t>& data)
+{
+	auto path = entry_path(key);
+	fs::create_directories(path.parent_path());
+
+	// Write to a unique temporary and rename it over the entry, readers never see a partial file
+	//
+	thread_local std::mt19937_64 rng{ std::random_device{}() };
+	auto temporary = path;
+	temporary += vtil::format::str(".%016llx.tmp", rng());
+	{
+		std::ofstream stream(temporary, std::ios::binary);
+		if (!stream.is_open())
+			fatal("Could not write cache entry '%s'", temporary.string());
+		stream.write((const char*)data.data(), data.size());
+	}
+
+	std::error_code ec;
+	bool existed = fs::exists(path, ec);
+	fs::rename(temporary, path, ec);
+	if (ec)
+	{
+		fs::remove(temporary, ec);
+		return;
+	}
+	stores++;
+
+	std::lock_guard _g(lock);
+	if (!existed)
+		total_bytes += data.size();
+	if (total_bytes > max_bytes)
+		evict();
+}
+
+void artifact_cache::evict()
+{
+	struct entry
+	{
+		fs::path path;
+		uint64_t size;
+		fs::file_time_type time;
+	};
+
+	// Rescan the directory since other processes may share it
+	//
+	std::vector<entry> entries;
+	total_bytes = 0;
+	for (const auto& item : fs::recursive_directory_iterator(root))
+	{
+		std::error_code ec;
+		if (!item.is_regular_file(ec) || item.path().extension() == ".tmp")
+			continue;
+		entry e{ item.path(), item.file_size(ec), item.last_write_time(ec) };
+		if (ec)
+			continue;
+		total_bytes += e.size;
+		entries.push_back(std::move(e));
+	}
+
+	// Drop the least recently used entries until the cache is back to 90% of its limit, so eviction
+	// does not run again on the very next store
+	//
+	std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) {
+		return a.time < b.time;
+	});
+	uint64_t target = max_bytes - max_bytes / 10;
+	for (const auto& e : entries)
+	{
+		if (total_bytes <= target)
+			break;
+		std::error_code ec;
+		if (fs::remove(e.path, ec))
+		{
+			total_bytes -= e.size;
+			evictions++;
+		}
+	}
+}
+
+void artifact_cache::report() const
+{
+	size_t lookups = hits + misses;
+	log_at(verbosity_level::normal, "[*] Cache: %llu hits, %llu misses (%.1f%% hit rate), %llu stored, %llu evicted, %.2f MB in use\n",
+		hits.load(), misses.load(), lookups ? 100.0 * hits / lookups : 0.0, stores.load(), evictions.load(), total_bytes / (1024.0 * 1024.0));
+}
@@ -0,0 +1,375 @@
+#include "vtil-utils.hpp"
+#include "lift.hpp"
+#include "lift_cache.hpp"
+#include "jit.hpp"
+#include "json.hpp"
+#include "vtil_pack.hpp"
+#include "artifact_cache.hpp"
+
+#include <vtil/compiler>
+
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <numeric>
+#include <thread>
+
+using namespace vtil;
+using namespace logger;
+
+namespace fs = std::filesystem;
+
+// Measurement of a single routine going through a stage, setup work is excluded from the time
+struct bench_sample
+{
+	double milliseconds;
+	size_t instructions;
+};
+
+struct stage_result
+{
+	std::string name;
+	size_t routines = 0;
+	size_t failures = 0;
+	size_t instructions = 0;
+	std::vector<double> repetitions;
+	std::vector<double> routine_milliseconds;
+
+	// Highest resident memory sampled during the stage above what was resident when it started, the
+	// process wide peak includes every earlier stage and cannot be attributed to one of them
+	uint64_t memory_growth = 0;
+};
+
+// Polls the resident memory of the process on a background thread and keeps the highest value
+class memory_sampler
+{
+	std::atomic<bool> running = true;
+	std::atomic<uint64_t> highest;
+	std::thread thread;
+
+public:
+	memory_sampler()
+		: highest(current_memory_bytes())
+	{
+		thread = std::thread([this]() {
+			while (running)
+			{
+				sample();
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+		});
+	}
+
+	~memory_sampler()
+	{
+		running = false;
+		thread.join();
+	}
+
+	void sample()
+	{
+		uint64_t current = current_memory_bytes();
+		uint64_t seen = highest;
+		while (current > seen && !highest.compare_exchange_weak(seen, current))
+			;
+	}
+
+	uint64_t peak()
+	{
+		sample();
+		return highest;
+	}
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Linearly interpolated percentile, p is in [0, 1]
+static double percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	double rank = p * (values.size() - 1);
+	size_t low = size_t(rank);
+	size_t high = std::min(low + 1, values.size() - 1);
+	return values[low] + (values[high] - values[low]) * (rank - low);
+}
+
+// Runs fn over every routine for the warmup and measured repetitions, routines that fail once are left
+// out of every later repetition so all repetitions measure the same work
+template<typename F>
+static stage_result run_stage(const char* name, size_t count, size_t warmup, size_t repeat, F&& fn)
+{
+	stage_result result;
+	result.name = name;
+	result.routines = count;
+
+	uint64_t resident = current_memory_bytes();
+	memory_sampler sampler;
+
+	std::vector<bool> failed(count);
+	for (size_t rep = 0; rep < warmup + repeat; rep++)
+	{
+		bool measured = rep >= warmup;
+		double total = 0;
+		size_t instructions = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (failed[i])
+				continue;
+
+			bench_sample sample;
+			try
+			{
+				sample = fn(i);
+			}
+			catch (const std::exception& e)
+			{
+				log<CON_RED>("[%s] routine %llu failed: %s\n", name, i, e.what());
+				failed[i] = true;
+				continue;
+			}
+
+			total += sample.milliseconds;
+			instructions += sample.instructions;
+			if (measured)
+				result.routine_milliseconds.push_back(sample.milliseconds);
+		}
+
+		if (measured)
+		{
+			result.repetitions.push_back(total);
+			result.instructions = instructions;
+		}
+	}
+
+	result.failures = std::count(failed.begin(), failed.end(), true);
+	uint64_t peak = sampler.peak();
+	result.memory_growth = peak > resident ? peak - resident : 0;
+	return result;
+}
+
+static json::value stage_report(const stage_result& stage)
+{
+	double median = percentile(stage.repetitions, 0.5);
+	double seconds = median / 1000;
+	size_t measured = stage.routines - stage.failures;
+
+	json::value report = json::value::object();
+	report["routines"] = uint64_t(stage.routines);
+	report["failures"] = uint64_t(stage.failures);
+	report["instructions"] = uint64_t(stage.instructions);
+
+	json::value repetitions = json::value::array();
+	for (double ms : stage.repetitions)
+		repetitions.push_back(ms);
+	report["repetitions_ms"] = std::move(repetitions);
+
+	report["median_ms"] = median;
+	report["min_ms"] = stage.repetitions.empty() ? 0.0 : *std::min_element(stage.repetitions.begin(), stage.repetitions.end());
+	report["mean_ms"] = stage.repetitions.empty() ? 0.0 : std::accumulate(stage.repetitions.begin(), stage.repetitions.end(), 0.0) / stage.repetitions.size();
+	report["p90_ms"] = percentile(stage.repetitions, 0.9);
+	report["routine_median_ms"] = percentile(stage.routine_milliseconds, 0.5);
+	report["routine_p90_ms"] = percentile(stage.routine_milliseconds, 0.9);
+	report["routine_p99_ms"] = percentile(stage.routine_milliseconds, 0.99);
+	report["routine_max_ms"] = percentile(stage.routine_milliseconds, 1.0);
+	report["routines_per_second"] = seconds > 0 ? measured / seconds : 0.0;
+	report["instructions_per_second"] = seconds > 0 ? stage.instructions / seconds : 0.0;
+	report["memory_growth_bytes"] = uint64_t(stage.memory_growth);
+	return report;
+}
+
+static void print_stage(const stage_result& stage)
+{
+	double median = percentile(stage.repetitions, 0.5);
+	double seconds = median / 1000;
+	size_t measured = stage.routines - stage.failures;
+	log_at(verbosity_level::normal, "%-12s %8llu %10.2f %10.2f %10.3f %10.3f %12.1f %14.1f %10.1f\n",
+		stage.name, measured, median, percentile(stage.repetitions, 0.9),
+		percentile(stage.routine_milliseconds, 0.5), percentile(stage.routine_milliseconds, 0.99),
+		seconds > 0 ? measured / seconds : 0.0, seconds > 0 ? stage.instructions / seconds : 0.0,
+		stage.memory_growth / (1024.0 * 1024.0));
+}
+
+// Compares the median stage times against a baseline report, returns the number of regressions
+static size_t compare_baseline(const json::value& report, const json::value& baseline, double threshold)
+{
+	size_t regressions = 0;
+	auto stages = report.find("stages");
+	auto baseline_stages = baseline.find("stages");
+	if (!stages || !baseline_stages)
+		fatal("Baseline has no stages");
+
+	for (const auto& [name, stage] : stages->members)
+	{
+		auto previous = baseline_stages->find(name);
+		if (!previous || !previous->find("median_ms"))
+		{
+			log_at(verbosity_level::normal, "[*] %s: not in baseline\n", name);
+			continue;
+		}
+
+		double before = previous->find("median_ms")->as_double();
+		double after = stage.find("median_ms")->as_double();
+		double change = before > 0 ? (after - before) / before * 100 : 0;
+		if (change > threshold)
+		{
+			regressions++;
+			log<CON_RED>("[*] %s: %.2fms -> %.2fms (%+.1f%%), regression above %.1f%%\n", name, before, after, change, threshold);
+		}
+		else
+		{
+			log_at(verbosity_level::normal, "[*] %s: %.2fms -> %.2fms (%+.1f%%)\n", name, before, after, change);
+		}
+	}
+	return regressions;
+}
+
+static args::Command bench(commands(), "bench", "Benchmark lifting, optimization and compilation", [](args::Subparser& parser) {
+	// Argument handling
+	args::PositionalList<std::string> corpus(parser, "corpus", ".vtil files, pack.vtilpack:name or directories used for opt and compile");
+	args::ValueFlag<std::string> exe(parser, "exe", "Executable used for the lift stage", { "exe" });
+	args::ValueFlagList<std::string> addrs(parser, "addr", "Hexadecimal address of a function to lift, defaults to every .pdata function", { "addr" });
+	args::ValueFlag<size_t> maxFunctions(parser, "count", "Maximum number of functions to lift", { "max-functions" }, 256);
+	args::ValueFlag<std::string> stages(parser, "stages", "Comma separated stages to run out of lift, lift-cached, opt and compile", { "stages" }, "lift,lift-cached,opt,compile");
+	args::ValueFlag<size_t> warmup(parser, "count", "Unmeasured repetitions before measuring", { "warmup" }, 1);
+	args::ValueFlag<size_t> repeat(parser, "count", "Measured repetitions", { "repeat" }, 5);
+	args::ValueFlag<std::string> jsonOutput(parser, "file", "Write the results as JSON", { "json" });
+	args::ValueFlag<std::string> baseline(parser, "file", "Compare against a JSON report of an earlier run", { "baseline" });
+	args::ValueFlag<double> threshold(parser, "percent", "Median slowdown that counts as a regression", { "threshold" }, 10.0);
+	parser.Parse();
+
+	auto enabled = [&](const std::string& stage) {
+		std::string list = "," + stages.Get() + ",";
+		return list.find("," + stage + ",") != std::string::npos;
+	};
+	size_t repetitions = std::max<size_t>(repeat.Get(), 1);
+
+	// Load the inputs up front so file system time stays out of the measurements
+	//
+	std::vector<std::vector<uint8_t>> serialized;
+	for (const auto& input : corpus.Get())
+	{
+		auto ref = parse_routine_ref(input);
+		if (ref.in_pack() || !fs::is_directory(ref.file))
+		{
+			serialized.push_back(read_routine_bytes(ref));
+			continue;
+		}
+		for (const auto& file : enum_vtil_files(input))
+			serialized.push_back(read_file_bytes(file));
+	}
+
+	json::value report = json::value::object();
+	report["version"] = VTIL_UTILS_CACHE_VERSION;
+	report["warmup"] = uint64_t(warmup.Get());
+	report["repeat"] = uint64_t(repetitions);
+	auto& stage_reports = report["stages"] = json::value::object();
+
+	log_at(verbosity_level::normal, "%-12s %8s %10s %10s %10s %10s %12s %14s %10s\n",
+		"stage", "routines", "median ms", "p90 ms", "rtn p50", "rtn p99", "routines/s", "instructions/s", "mem +MB");
+
+	// Lift only runs by default when there is an executable to lift from
+	//
+	if ((enabled("lift") || enabled("lift-cached")) && (exe || stages))
+	{
+		if (!exe)
+			fatal("The lift stages need --exe");
+
+		loaded_pe pe(exe.Get());
+		std::vector<uint64_t> functions;
+		for (const auto& addr : addrs.Get())
+			functions.push_back(std::stoull(addr, nullptr, 16));
+		if (functions.empty())
+			functions = enum_pdata_functions(*pe.input);
+		if (functions.size() > maxFunctions.Get())
+			functions.resize(maxFunctions.Get());
+		if (functions.empty())
+			fatal("No functions to lift in '%s'", exe.Get());
+
+		auto lift_stage = [&](const char* name) {
+			auto stage = run_stage(name, functions.size(), warmup.Get(), repetitions, [&](size_t index) {
+				auto t0 = std::chrono::steady_clock::now();
+				std::unique_ptr<routine> rtn{ lift_function(*pe.input, functions[index]) };
+				double ms = elapsed_ms(t0);
+				return bench_sample{ ms, rtn->num_instructions() };
+			});
+			print_stage(stage);
+			stage_reports[name] = stage_report(stage);
+		};
+
+		// The warmup would fill the process wide lift cache and leave the measured repetitions replaying
+		// it, so lift runs without the cache and stays comparable with reports from before it existed.
+		// lift-cached starts from an empty cache and measures the replays separately.
+		//
+		auto& cache = lift_cache::instance();
+		bool cache_enabled = cache.enabled.exchange(false);
+		if (enabled("lift"))
+			lift_stage("lift");
+		if (enabled("lift-cached"))
+		{
+			cache.clear();
+			cache.enabled = true;
+			lift_stage("lift-cached");
+		}
+		cache.enabled = cache_enabled;
+	}
+
+	if ((enabled("opt") || enabled("compile")) && serialized.empty() && (stages || !exe))
+		fatal("The opt and compile stages need a corpus of .vtil files");
+
+	if (enabled("opt") && !serialized.empty())
+	{
+		auto stage = run_stage("opt", serialized.size(), warmup.Get(), repetitions, [&](size_t index) {
+			std::unique_ptr<routine> rtn{ deserialize_routine(serialized[index].data(), serialized[index].size()) };
+			size_t instructions = rtn->num_instructions();
+
+			auto t0 = std::chrono::steady_clock::now();
+			optimizer::apply_all(rtn.get());
+			return bench_sample{ elapsed_ms(t0), instructions };
+		});
+		print_stage(stage);
+		stage_reports["opt"] = stage_report(stage);
+	}
+
+	if (enabled("compile") && !serialized.empty())
+	{
+		std::vector<std::unique_ptr<routine>> routines;
+		for (const auto& data : serialized)
+			routines.emplace_back(deserialize_routine(data.data(), data.size()));
+
+		asmjit::JitRuntime rt;
+		jit_context context(rt.environment());
+		auto stage = run_stage("compile", routines.size(), warmup.Get(), repetitions, [&](size_t index) {
+			auto t0 = std::chrono::steady_clock::now();
+			context.compile(routines[index].get());
+			return bench_sample{ elapsed_ms(t0), routines[index]->num_instructions() };
+		});
+		print_stage(stage);
+		stage_reports["compile"] = stage_report(stage);
+	}
+	report["process_peak_memory_bytes"] = peak_memory_bytes();
+
+	if (jsonOutput)
+	{
+		std::ofstream out(jsonOutput.Get());
+		if (!out.is_open())
+			fatal("Failed to open JSON file '%s'", jsonOutput.Get());
+		out << report.dump(true) << '\n';
+	}
+
+	if (baseline)
+	{
+		std::ifstream in(baseline.Get());
+		if (!in.is_open())
+			fatal("Failed to open baseline '%s'", baseline.Get());
+		std::string text{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+
+		if (size_t regressions = compare_baseline(report, json::parse(text), threshold.Get()))
+			fatal("%llu stages regressed by more than %.1f%%", regressions, threshold.Get());
+	}
+});
@@ -14,11 +14,22 @@
 
 #include <asmjit/x86.h>
 #include <asmjit/x86/x86operand.h>
-#include <set>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <string_view>
+#include <unordered_set>
 #include <unordered_map>
 #include <vtil/arch>
 #include <vtil/vtil>
 #include <vtil-utils.hpp>
+#include <jit.hpp>
+#include <artifact_cache.hpp>
+#include <vtil_pack.hpp>
 
 using namespace asmjit;
 namespace ins
@@ -26,17 +37,109 @@ namespace ins
 using namespace vtil::ins;
 };
 
-static void compile(vtil::basic_block* basic_block, struct routine_state* state);
+// Identity of a VTIL register regardless of the bits an operand selects from it
+//
+struct register_key
+{
+	uint64_t flags;
+	uint64_t id;
+
+	explicit register_key(const vtil::register_desc& reg)
+		: flags(reg.flags)
+		, id(reg.combined_id)
+	{
+	}
+
+	bool operator==(const register_key& other) const
+	{
+		return flags == other.flags && id == other.id;
+	}
+};
+
+struct register_key_hash
+{
+	size_t operator()(const register_key& key) const
+	{
+		return std::hash<uint64_t>()(key.id * 0x9E3779B97F4A7C15ull ^ key.flags);
+	}
+};
+
+// Sub-register of a full register that covers the low `bits`, one bit values live in the low byte
+//
+static x86::Gp sized_view(const x86::Gp& full, vtil::bitcnt_t bits)
+{
+	if (bits <= 8)
+		return full.r8();
+	if (bits <= 16)
+		return full.r16();
+	if (bits <= 32)
+		return full.r32();
+	return full.r64();
+}
+
+static bool is_native_width(vtil::bitcnt_t bits)
+{
+	return bits == 8 || bits == 16 || bits == 32 || bits == 64;
+}
 
 struct routine_state
 {
 	std::unordered_map<vtil::vip_t, Label> label_map;
-	std::set<vtil::vip_t> is_compiled;
-	std::unordered_map<vtil::operand::register_t, x86::Gp> reg_map;
+	vtil::basic_block* next_block = nullptr;
+
+	// Jump tables are emitted as data after the function ends
+	//
+	struct jump_table
+	{
+		Label label;
+		std::vector<Label> entries;
+	};
+	std::vector<jump_table> jump_tables;
+	std::unordered_map<register_key, x86::Gp, register_key_hash> reg_map;
 	x86::Gp flags_reg;
+
+	// Highest bit any operand touches per virtual register, registers that fit 32 bits are allocated as
+	// 32-bit registers so every write zero extends for free
+	//
+	std::unordered_map<register_key, vtil::bitcnt_t, register_key_hash> extents;
+
+	// Whether operands are accessed at their own width, see narrow_registers_enabled
+	//
+	bool narrow = true;
+
+	// Operands of the current instruction that are not a plain low sub-register of their full register,
+	// the handler works on a scratch register that is extracted before and merged back after it
+	//
+	struct operand_scratch
+	{
+		vtil::register_desc reg;
+		x86::Gp gp;
+		bool written;
+	};
+	std::vector<operand_scratch> scratch;
 	x86::Compiler& cc;
 	Imm base_address;
 
+	// Constants materialized in the current block, they are reused until the next block starts
+	//
+	std::unordered_map<int64_t, x86::Gp> constant_cache;
+	x86::Gp image_base_reg;
+
+	// Instructions that only write flag bits nothing reads, see find_dead_flag_writes
+	//
+	std::unordered_set<const vtil::instruction*> dead_flag_writes;
+
+	// EFLAGS currently hold whether `reg` is non-zero as the condition code `cond`, either from a
+	// `test reg, reg` or from the `cmp` of the tX instruction that produced it. Anything that clobbers the
+	// flags or writes the register resets it, so consumers of the same condition reuse the flags.
+	//
+	struct flags_condition
+	{
+		vtil::register_desc reg;
+		uint32_t cond;
+	};
+	std::optional<flags_condition> flags;
+
 	routine_state(x86::Compiler& cc, uint64_t base)
 		: cc(cc)
 		, base_address(base)
@@ -59,40 +162,268 @@ struct routine_state
 		}
 	}
 
-	x86::Gp reg_for_size(vtil::operand const& operand)
+	vtil::bitcnt_t extent_of(const vtil::register_desc& reg) const
+	{
+		if (reg.is_physical())
+			return 64;
+		auto it = extents.find(register_key(reg));
+		return it != extents.end() ? it->second : 64;
+	}
+
+	// One bit registers that are never accessed wider hold exactly 0 or 1 in their low byte
+	//
+	bool is_clean_bit(const vtil::register_desc& reg) const
+	{
+		return reg.bit_count == 1 && reg.bit_offset == 0 && extent_of(reg) <= 1;
+	}
+
+	// Reads need a scratch register unless the value is exactly the low byte, word, dword or qword
+	//
+	bool needs_extract(const vtil::register_desc& reg) const
+	{
+		if (!narrow)
+			return reg.bit_offset != 0 || reg.bit_count != 64;
+		return reg.bit_offset != 0 || !(is_native_width(reg.bit_count) || is_clean_bit(reg));
+	}
+
+	// Writes additionally need one for 32-bit values, as a 32-bit write would clear the upper half
+	//
+	bool needs_merge(const vtil::register_desc& reg) const
+	{
+		if (reg.bit_count == 32 && reg.bit_offset == 0)
+			return extent_of(reg) > 32;
+		return needs_extract(reg);
+	}
+
+	// Truncates the low `bits` of a 64-bit scratch register, zero extending them to the full register
+	//
+	void zero_extend(const x86::Gp& gp, vtil::bitcnt_t bits)
+	{
+		if (bits == 8)
+			cc.movzx(gp.r32(), gp.r8());
+		else if (bits == 16)
+			cc.movzx(gp.r32(), gp.r16());
+		else if (bits == 32)
+			cc.mov(gp.r32(), gp.r32());
+		else if (bits < 32)
+			cc.and_(gp.r32(), int64_t((1ull << bits) - 1));
+		else if (bits < 64)
+			cc.and_(gp, materialize(int64_t((1ull << bits) - 1)));
+	}
+
+	void extract(const x86::Gp& gp, const vtil::register_desc& reg)
+	{
+		x86::Gp full = full_reg(reg);
+		if (full.size() == 8)
+			cc.mov(gp, full);
+		else
+			cc.mov(gp.r32(), full.r32());
+		if (reg.bit_offset)
+			cc.shr(gp, reg.bit_offset);
+		if (!is_native_width(reg.bit_count))
+			zero_extend(gp, reg.bit_count);
+	}
+
+	void merge(const x86::Gp& gp, const vtil::register_desc& reg)
+	{
+		x86::Gp full = full_reg(reg);
+		zero_extend(gp, reg.bit_count);
+		if (reg.bit_offset)
+			cc.shl(gp, reg.bit_offset);
+
+		uint64_t mask = (reg.bit_count >= 64 ? ~0ull : (1ull << reg.bit_count) - 1) << reg.bit_offset;
+		emit_imm(x86::Inst::kIdAnd, full, int64_t(~mask));
+		cc.or_(full, full.size() == 8 ? gp : gp.r32());
+	}
+
+	// Sets up scratch registers for the operands of an instruction before its handler runs
+	//
+	void bind_operands(const vtil::instruction& instr)
+	{
+		scratch.clear();
+		for (size_t i = 0; i < instr.operands.size(); i++)
+		{
+			if (!instr.operands[i].is_register())
+				continue;
+
+			const vtil::register_desc& reg = instr.operands[i].reg();
+			if (reg.is_stack_pointer())
+				continue;
+
+			auto type = instr.base->operand_types[i];
+			bool read = type != vtil::operand_type::write;
+			bool written = type >= vtil::operand_type::write;
+
+			auto bound = std::find_if(scratch.begin(), scratch.end(), [&](const operand_scratch& entry) { return entry.reg == reg; });
+			if (bound != scratch.end())
+			{
+				bound->written |= written;
+				continue;
+			}
+			if (!(read && needs_extract(reg)) && !(written && needs_merge(reg)))
+				continue;
+
+			// Extracting shifts and masks, which leaves the flags describing something else
+			//
+			x86::Gp gp = cc.newGpq();
+			if (read)
+			{
+				extract(gp, reg);
+				flags.reset();
+			}
+			scratch.push_back({ reg, gp, written });
+		}
+	}
+
+	// Merges the scratch registers of written operands back into their full registers
+	//
+	void commit_operands()
 	{
-		switch (operand.bit_count())
+		for (auto& entry : scratch)
 		{
-		// TODO: Handle sized register access
-		//
-		case 1:
-		case 8:
-		case 16:
-		case 32:
-		case 64:
-			return cc.newGpq();
-		default:
-			unreachable();
+			if (!entry.written)
+				continue;
+			merge(entry.gp, entry.reg);
+			flags.reset();
+		}
+		scratch.clear();
+	}
+
+	// Register operand viewed at the given width, narrower registers are zero extended first
+	//
+	x86::Gp get_reg_as(const vtil::register_desc& reg, vtil::bitcnt_t bits)
+	{
+		x86::Gp gp = get_reg(reg);
+		if (reg.bit_count >= bits || reg.bit_count > 32)
+			return sized_view(gp, bits);
+
+		x86::Gp wide = cc.newGpq();
+		if (reg.bit_count <= 16)
+			cc.movzx(wide.r32(), gp);
+		else
+			cc.mov(wide.r32(), gp.r32());
+		return sized_view(wide, bits);
+	}
+
+	// Keeps a one bit result at 0 or 1 after arithmetic that may have carried into the rest of its byte
+	//
+	void truncate(const vtil::register_desc& reg)
+	{
+		if (reg.bit_count == 1)
+			cc.and_(get_reg(reg), 1);
+	}
+
+	// Whether the block at the given address is laid out right after the current one
+	//
+	bool is_next(vtil::vip_t address) const
+	{
+		return next_block && next_block->entry_vip == address;
+	}
+
+	void jump_to(vtil::vip_t address)
+	{
+		if (!is_next(address))
+			cc.jmp(get_label(address));
+	}
+
+	void emit_jump_tables()
+	{
+		for (auto& table : jump_tables)
+		{
+			cc.align(kAlignData, 4);
+			cc.bind(table.label);
+			for (auto& entry : table.entries)
+				cc.embedLabelDelta(entry, table.label, 4);
+		}
+	}
+
+	void begin_block()
+	{
+		constant_cache.clear();
+		image_base_reg.reset();
+		flags.reset();
+	}
+
+	// Returns the condition code that holds when the register is non-zero, testing the register only if
+	// the flags do not already describe it
+	//
+	uint32_t condition_of(const vtil::register_desc& reg)
+	{
+		if (!flags || !(flags->reg == reg))
+		{
+			x86::Gp gp = get_reg(reg);
+			cc.test(gp, gp);
+			flags = flags_condition{ reg, x86::Condition::kNZ };
 		}
+		return flags->cond;
+	}
+
+	x86::Gp materialize(int64_t value)
+	{
+		auto it = constant_cache.find(value);
+		if (it != constant_cache.end())
+			return it->second;
+
+		x86::Gp reg = cc.newGpq();
+		cc.mov(reg, value);
+		constant_cache.emplace(value, reg);
+		return reg;
 	}
 
 	x86::Gp tmp_imm(vtil::operand const& reg)
 	{
-		x86::Gp tmp = reg_for_size(reg);
-		cc.mov(tmp, reg.imm().ival);
-		return tmp;
+		return materialize(reg.imm().ival);
+	}
+
+	// Emits `inst dst, value`. Immediates that fit a sign-extended imm32 are encoded directly (AsmJit picks
+	// the imm8 form on its own when possible), only true 64-bit constants go through a register.
+	//
+	// Narrower destinations take the immediate truncated to their width.
+	//
+	void emit_imm(uint32_t inst_id, const x86::Gp& dst, int64_t value)
+	{
+		if (dst.size() == 1)
+			cc.emit(inst_id, dst, Imm(int8_t(value)));
+		else if (dst.size() == 2)
+			cc.emit(inst_id, dst, Imm(int16_t(value)));
+		else if (dst.size() == 4)
+			cc.emit(inst_id, dst, Imm(int32_t(value)));
+		else if (Support::isInt32(value))
+			cc.emit(inst_id, dst, Imm(value));
+		else
+			cc.emit(inst_id, dst, materialize(value));
+	}
+
+	void emit_binary(uint32_t inst_id, const x86::Gp& dst, vtil::operand const& src)
+	{
+		if (src.is_immediate())
+			emit_imm(inst_id, dst, src.imm().ival);
+		else
+			cc.emit(inst_id, dst, get_reg_as(src.reg(), dst.size() * 8));
 	}
 
+	// Register operand viewed at its own width, bit ranges that do not start at bit zero or are not a
+	// native width come from the scratch register bound for the current instruction
+	//
 	x86::Gp get_reg(vtil::operand::register_t const& operand)
 	{
-		using vtil::logger::log;
+		if (operand.is_stack_pointer())
+			return x86::rsp;
 
-		// TODO: Handle bit selectors on registers
+		for (auto& entry : scratch)
+		{
+			if (entry.reg == operand)
+				return sized_view(entry.gp, operand.bit_count);
+		}
+		return sized_view(full_reg(operand), operand.bit_count);
+	}
 
-		log("get_reg: %s\n", operand.to_string());
+	x86::Gp full_reg(vtil::operand::register_t const& operand)
+	{
+		LOG_TRACE("full_reg: %s\n", operand.to_string());
 		if (operand.is_physical())
 		{
-			log("\tis_physical\n");
+			LOG_TRACE("\tis_physical\n");
 			// Transform the VTIL register into an AsmJit one.
 			//
 			// TODO: This shouldnt be a separate condition, but just
@@ -100,7 +431,7 @@ struct routine_state
 			//
 			if (operand.is_stack_pointer())
 			{
-				log("\t\tis_stack_pointer\n");
+				LOG_TRACE("\t\tis_stack_pointer\n");
 				// TODO: this might cause problems, the stack
 				// of the program and of VTIL are shared
 				//
@@ -108,7 +439,7 @@ struct routine_state
 			}
 			else if (operand.is_flags())
 			{
-				log("\t\tis_flags: %d\n", flags_reg.isValid());
+				LOG_TRACE("\t\tis_flags: %d\n", flags_reg.isValid());
 				if (!flags_reg.isValid())
 				{
 					flags_reg = cc.newGpq();
@@ -118,7 +449,7 @@ struct routine_state
 			}
 			else
 			{
-				log("\t\tmachine_register: %s\n", vtil::amd64::name(operand.combined_id));
+				LOG_TRACE("\t\tmachine_register: %s\n", vtil::amd64::name(operand.combined_id));
 				switch (operand.combined_id)
 				{
 				case X86_REG_R8:
@@ -152,47 +483,263 @@ struct routine_state
 				case X86_REG_RDX:
 					return x86::rdx;
 				default:
-					abort();
+					fatal("Unsupported physical register '%s'", operand.to_string());
 				}
 			}
 		}
 		else
 		{
-			log("\tis_virtual\n");
+			LOG_TRACE("\tis_virtual\n");
 
 			if (operand.is_image_base())
 			{
-				log("\t\tis_image_base\n");
+				LOG_TRACE("\t\tis_image_base\n");
 				// TODO: This obviously won't work for different
 				// base addresses
 				//
-				x86::Gp base_reg = reg_for_size(operand);
-				cc.mov(base_reg, base_address);				
-				return base_reg;
+				if (!image_base_reg.isValid())
+				{
+					image_base_reg = cc.newGpq();
+					cc.mov(image_base_reg, base_address);
+				}
+				return image_base_reg;
 			}
 			else if (operand.is_flags())
 			{
-				log("\t\tis_flags\n");
-				abort();
+				LOG_TRACE("\t\tis_flags\n");
+				fatal("Virtual flags register '%s' is not supported", operand.to_string());
 			}
 			// Grab the register from the map, or create and insert otherwise.
 			//
-			else if (reg_map.count(operand))
-			{
-				return reg_map[operand];
-			}
-			else
-			{
-				x86::Gp reg = reg_for_size(operand);
-				reg_map[operand] = reg;
-				return reg;
-			}
+			auto [it, inserted] = reg_map.emplace(register_key(operand), x86::Gp());
+			if (inserted)
+				it->second = extent_of(operand) <= 32 ? x86::Gp(cc.newGpd()) : x86::Gp(cc.newGpq());
+			return it->second;
+		}
+	}
+};
+
+// Register-indirect jumps to at least this many targets are lowered to a jump table or compare tree
+//
+static constexpr size_t indirect_jump_min_targets = 4;
+
+// A jump table is used when at least this fraction of the entries between the lowest and highest
+// target is an actual target, and the table stays reasonably small
+//
+static constexpr double jump_table_min_density = 0.25;
+static constexpr uint64_t jump_table_max_entries = 4096;
+
+using indirect_target = std::pair<vtil::vip_t, Label>;
+
+// Balanced binary search over the sorted targets, O(log n) compares per dispatch
+//
+static void emit_compare_tree(routine_state* state, const x86::Gp& reg, const std::vector<indirect_target>& targets, size_t lo, size_t hi, const Label& miss)
+{
+	if (hi - lo < indirect_jump_min_targets)
+	{
+		for (size_t i = lo; i < hi; i++)
+		{
+			state->emit_imm(x86::Inst::kIdCmp, reg, targets[i].first);
+			state->cc.je(targets[i].second);
+		}
+		state->cc.jmp(miss);
+		return;
+	}
+
+	size_t mid = lo + (hi - lo) / 2;
+	Label upper = state->cc.newLabel();
+	state->emit_imm(x86::Inst::kIdCmp, reg, targets[mid].first);
+	state->cc.je(targets[mid].second);
+	state->cc.ja(upper);
+	emit_compare_tree(state, reg, targets, lo, mid, miss);
+	state->cc.bind(upper);
+	emit_compare_tree(state, reg, targets, mid + 1, hi, miss);
+}
+
+// Log2 of the largest power of two every distance between the targets is a multiple of, handler entry
+// points are usually aligned so the table can be indexed by the distance shifted right by this
+//
+static uint32_t jump_table_shift(const std::vector<indirect_target>& targets)
+{
+	uint64_t stride = 0;
+	for (auto& [vip, label] : targets)
+		stride = std::gcd(stride, vip - targets.front().first);
+
+	uint32_t shift = 0;
+	while (stride && !(stride & 1) && shift < 63)
+	{
+		stride >>= 1;
+		shift++;
+	}
+	return shift;
+}
+
+// Bounds-checked table of label deltas indexed by the distance from the lowest target divided by
+// 1 << shift. The distance is rotated rather than shifted, so values between two entries end up with
+// their low bits on top and fail the bounds check.
+//
+static void emit_jump_table(routine_state* state, const x86::Gp& reg, const std::vector<indirect_target>& targets, uint32_t shift, const Label& miss)
+{
+	auto& cc = state->cc;
+	uint64_t first = targets.front().first;
+	uint64_t count = ((targets.back().first - first) >> shift) + 1;
+
+	routine_state::jump_table table{ cc.newLabel(), std::vector<Label>(count, miss) };
+	JumpAnnotation* annotation = cc.newJumpAnnotation();
+	annotation->addLabel(miss);
+	for (auto& [vip, label] : targets)
+	{
+		table.entries[(vip - first) >> shift] = label;
+		annotation->addLabel(label);
+	}
+
+	x86::Gp index = cc.newGpq();
+	x86::Gp base = cc.newGpq();
+	x86::Gp target = cc.newGpq();
+	cc.mov(index, reg);
+	state->emit_imm(x86::Inst::kIdSub, index, first);
+	if (shift)
+		cc.ror(index, shift);
+	state->emit_imm(x86::Inst::kIdCmp, index, count - 1);
+	cc.ja(miss);
+	cc.lea(base, x86::ptr(table.label));
+	cc.movsxd(target, x86::dword_ptr(base, index, 2));
+	cc.add(target, base);
+	cc.jmp(target, annotation);
+
+	state->jump_tables.push_back(std::move(table));
+}
+
+// Lowers `jmp reg` over the known successors. Dense target sets use a jump table, sparse ones a compare
+// tree and small ones a linear compare chain. Values that match no known successor trap.
+//
+static void emit_indirect_jump(routine_state* state, const x86::Gp& reg, const std::vector<vtil::basic_block*>& destinations)
+{
+	std::vector<indirect_target> targets;
+	for (vtil::basic_block* destination : destinations)
+		targets.emplace_back(destination->entry_vip, state->get_label(destination->entry_vip));
+	std::sort(targets.begin(), targets.end(), [](const indirect_target& a, const indirect_target& b) {
+		return a.first < b.first;
+	});
+	targets.erase(std::unique(targets.begin(), targets.end(), [](const indirect_target& a, const indirect_target& b) {
+		return a.first == b.first;
+	}),
+		targets.end());
+
+	// Density is measured in table entries, not in bytes between the targets
+	//
+	bool dense = false;
+	uint32_t shift = 0;
+	if (targets.size() >= indirect_jump_min_targets)
+	{
+		shift = jump_table_shift(targets);
+		uint64_t span = (targets.back().first - targets.front().first) >> shift;
+		dense = span < jump_table_max_entries && targets.size() >= jump_table_min_density * (span + 1);
+	}
+
+	Label miss = state->cc.newLabel();
+	if (dense)
+		emit_jump_table(state, reg, targets, shift, miss);
+	else
+		emit_compare_tree(state, reg, targets, 0, targets.size(), miss);
+
+	state->cc.bind(miss);
+	state->cc.ud2();
+}
+
+// Whether the result of the tX instruction is only read, as its condition, by the js or ifs right after
+// it. The consumer then takes the condition straight from the flags and the result is never stored.
+// Temporaries do not outlive their block, so a js consumer is always the last reader. Consumers whose
+// operands go through scratch registers are not fused, extracting them would clobber the flags first.
+//
+static bool is_fused_condition(const vtil::il_iterator& instr, const routine_state* state)
+{
+	const vtil::register_desc& result = instr->operands[0].reg();
+	if (!result.is_local())
+		return false;
+
+	auto consumer = instr;
+	if ((++consumer).is_end())
+		return false;
+
+	for (size_t i = 0; i < consumer->operands.size(); i++)
+	{
+		if (!consumer->operands[i].is_register() || consumer->operands[i].reg().is_stack_pointer())
+			continue;
+
+		const vtil::register_desc& reg = consumer->operands[i].reg();
+		auto type = consumer->base->operand_types[i];
+		if (type != vtil::operand_type::write && state->needs_extract(reg))
+			return false;
+		if (type >= vtil::operand_type::write && state->needs_merge(reg))
+			return false;
+	}
+
+	if (*consumer->base == ins::js)
+		return consumer->operands[0].is_register() && consumer->operands[0].reg() == result;
+
+	if (*consumer->base != ins::ifs || !consumer->operands[1].is_register() || !(consumer->operands[1].reg() == result))
+		return false;
+	if (consumer->operands[2].is_register() && consumer->operands[2].reg().overlaps(result))
+		return false;
+
+	for (auto later = consumer; !(++later).is_end();)
+	{
+		for (size_t i = 0; i < later->operands.size(); i++)
+		{
+			if (later->base->operand_types[i] != vtil::operand_type::write && later->operands[i].is_register() && later->operands[i].reg().overlaps(result))
+				return false;
 		}
 	}
+	return true;
+}
+
+// Compares the operands of a tX instruction. `cond` is the condition for `cmp lhs, rhs`, `swapped` the
+// same relation with the operands exchanged, which is needed when only the left-hand side is immediate.
+//
+static void emit_conditional(const vtil::il_iterator& instr, routine_state* state, uint32_t cond, uint32_t swapped)
+{
+	const vtil::register_desc& result = instr->operands[0].reg();
+	auto& lhs = instr->operands[1];
+	auto& rhs = instr->operands[2];
+
+	uint32_t condition = cond;
+	if (lhs.is_immediate())
+	{
+		state->emit_binary(x86::Inst::kIdCmp, state->get_reg(rhs.reg()), lhs);
+		condition = swapped;
+	}
+	else
+	{
+		state->emit_binary(x86::Inst::kIdCmp, state->get_reg(lhs.reg()), rhs);
+	}
+
+	// setcc and movzx leave the flags alone, so a consumer can still use them after materializing
+	//
+	if (!is_fused_condition(instr, state))
+	{
+		x86::Gp gp = state->get_reg(result);
+		state->cc.emit(x86::Inst::setccFromCond(condition), gp.r8());
+		state->cc.movzx(gp.r32(), gp.r8());
+	}
+	state->flags = routine_state::flags_condition{ result, condition };
+}
+
+using fn_instruction_compiler_t = void (*)(const vtil::il_iterator&, routine_state*);
+
+// Handlers that preserve EFLAGS, or keep routine_state::flags up to date themselves, are marked so the flags they
+// leave behind can be reused by the next instruction
+//
+struct instruction_handler
+{
+	vtil::instruction_desc desc;
+	fn_instruction_compiler_t compile;
+	bool preserves_flags = false;
 };
 
-using fn_instruction_compiler_t = std::function<void(const vtil::il_iterator&, routine_state*)>;
-static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler_table = {
+// Handlers are dispatched by their dense index in this table, see handler_index
+//
+static const instruction_handler handler_table[] = {
 	{
 		ins::ldd,
 		[](const vtil::il_iterator& instr, routine_state* state) {
@@ -204,6 +751,7 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			//
 			state->cc.mov(state->get_reg(dest), x86::ptr(state->get_reg(src), offset.ival));
 		},
+		true,
 	},
 	{
 		ins::str,
@@ -233,77 +781,125 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 				dest = x86::ptr_64(reg_base, offset.ival);
 				break;
 			default:
-				unreachable();
+				fatal("Unsupported %d-bit store", int(v.bit_count()));
 			}
 
 			if (v.is_immediate())
 			{
-				state->cc.mov(dest, v.imm().ival);
+				// Stores only take a sign-extended imm32
+				//
+				if (v.bit_count() == 64 && !Support::isInt32(v.imm().ival))
+					state->cc.mov(dest, state->tmp_imm(v));
+				else
+					state->cc.mov(dest, v.imm().ival);
 			}
 			else
 			{
 				state->cc.mov(dest, state->get_reg(v.reg()));
 			}
 		},
+		true,
 	},
 	{
 		ins::mov,
 		[](const vtil::il_iterator& instr, routine_state* state) {
 			auto dest = instr->operands[0].reg();
 			auto src = instr->operands[1];
+			x86::Gp dst = state->get_reg(dest);
 
 			if (src.is_immediate())
 			{
-				state->cc.mov(state->get_reg(dest), src.imm().ival);
+				int64_t value = src.imm().ival;
+				if (dest.bit_count < 64)
+					value &= (1ll << dest.bit_count) - 1;
+				state->cc.mov(dst, value);
+			}
+			else if (src.reg().bit_count >= dest.bit_count)
+			{
+				// Narrowing to a single bit needs the `and`, which is the only flag clobber here
+				//
+				state->cc.mov(dst, sized_view(state->get_reg(src.reg()), dest.bit_count));
+				if (dest.bit_count == 1 && src.reg().bit_count > 1)
+				{
+					state->truncate(dest);
+					state->flags.reset();
+				}
 			}
 			else
 			{
-				state->cc.mov(state->get_reg(dest), state->get_reg(src.reg()));
+				// One bit values are already zero extended to their byte, 32-bit moves zero extend on their own
+				//
+				x86::Gp value = state->get_reg(src.reg());
+				if (value.size() == dst.size())
+					state->cc.mov(dst, value);
+				else if (value.size() < 4)
+					state->cc.movzx(dst.size() > 2 ? dst.r32() : dst, value);
+				else
+					state->cc.mov(dst.r32(), value.r32());
 			}
 		},
+		true,
 	},
 	{
-		ins::sub,
+		ins::movsx,
 		[](const vtil::il_iterator& instr, routine_state* state) {
 			auto dest = instr->operands[0].reg();
 			auto src = instr->operands[1];
+			x86::Gp dst = state->get_reg(dest);
 
 			if (src.is_immediate())
 			{
-				x86::Gp tmp = state->reg_for_size(src);
-				state->cc.mov(tmp, src.imm().ival);
-				state->cc.sub(state->get_reg(dest), tmp);
+				int64_t value = src.imm().ival;
+				if (dest.bit_count < 64)
+					value &= (1ll << dest.bit_count) - 1;
+				state->cc.mov(dst, value);
+				return;
+			}
 
-				// AsmJit shits its pants when I use this, so we move to a temporary
-				// instead. TODO: Investigate
-				// state->cc.sub( state->get_reg( dest ), src.imm().ival );
+			x86::Gp value = state->get_reg(src.reg());
+			vtil::bitcnt_t bits = src.reg().bit_count;
+			if (bits >= dest.bit_count)
+			{
+				state->cc.mov(dst, sized_view(value, dest.bit_count));
+			}
+			else if (bits == 1)
+			{
+				// 0 or 1 becomes 0 or all ones
 				//
+				if (dst.size() == 1)
+					state->cc.mov(dst, value);
+				else
+					state->cc.movzx(dst.size() > 2 ? dst.r32() : dst, value);
+				state->cc.neg(dst);
+			}
+			else if (bits == 32)
+			{
+				state->cc.movsxd(dst, value);
 			}
 			else
 			{
-				state->cc.sub(state->get_reg(dest), state->get_reg(src.reg()));
+				state->cc.movsx(dst, value);
 			}
 		},
 	},
+	{
+		ins::sub,
+		[](const vtil::il_iterator& instr, routine_state* state) {
+			auto dest = instr->operands[0].reg();
+			auto src = instr->operands[1];
+
+			state->emit_binary(x86::Inst::kIdSub, state->get_reg(dest), src);
+			state->truncate(dest);
+		},
+	},
 	{
 		ins::add,
 		[](const vtil::il_iterator& instr, routine_state* state) {
 			auto lhs = instr->operands[0].reg();
 			auto rhs = instr->operands[1];
 
-			if (rhs.is_immediate())
-			{
-				x86::Gp tmp = state->reg_for_size(rhs);
-				state->cc.mov(tmp, rhs.imm().ival);
-				state->cc.add(state->get_reg(lhs), tmp);
-
-				// See note on sub
-				//
-			}
-			else
-			{
-				state->cc.add(state->get_reg(lhs), state->get_reg(rhs.reg()));
-			}
+			state->emit_binary(x86::Inst::kIdAdd, state->get_reg(lhs), rhs);
+			state->truncate(lhs);
 		},
 	},
 	{
@@ -315,48 +911,38 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 
 			fassert(dst_1.is_immediate() && dst_2.is_immediate());
 
-			// TODO: We should check if the block is compiled in order to avoid the
-			// jump here, but I think the optimizer removes this?
-			//
-			state->cc.test(state->get_reg(cond), state->get_reg(cond));
-
-			state->cc.jnz(state->get_label(dst_1.imm().uval));
-			state->cc.jmp(state->get_label(dst_2.imm().uval));
+			uint32_t condition = state->condition_of(cond);
 
-			for (vtil::basic_block* destination : it.block->next)
+			// Only branch away from the block that is laid out next
+			//
+			auto taken = dst_1.imm().uval;
+			auto not_taken = dst_2.imm().uval;
+			if (state->is_next(taken))
+			{
+				state->cc.emit(x86::Inst::jccFromCond(x86::Condition::negate(condition)), state->get_label(not_taken));
+			}
+			else
 			{
-				if (!state->is_compiled.count(destination->entry_vip))
-					compile(destination, state);
+				state->cc.emit(x86::Inst::jccFromCond(condition), state->get_label(taken));
+				state->jump_to(not_taken);
 			}
 		},
+		true,
 	},
 	{
 		ins::jmp,
 		[](const vtil::il_iterator& it, routine_state* state) {
-			vtil::debug::dump(*it);
 			if (it->operands[0].is_register())
 			{
 				const vtil::operand::register_t cond = it->operands[0].reg();
 
-				for (vtil::basic_block* destination : it.block->next)
-				{
-					state->cc.cmp(state->get_reg(cond), destination->entry_vip);
-					state->cc.je(state->get_label(destination->entry_vip));
-
-					if (!state->is_compiled.count(destination->entry_vip))
-						compile(destination, state);
-				}
+				emit_indirect_jump(state, state->get_reg(cond), it.block->next);
 			}
 			else
 			{
 				fassert(it->operands[0].is_immediate());
 
-				auto dest = it.block->next[0]->entry_vip;
-
-				state->cc.jmp(state->get_label(dest));
-
-				if (!state->is_compiled.count(dest))
-					compile(it.block->next[0], state);
+				state->jump_to(it.block->next[0]->entry_vip);
 			}
 		},
 	},
@@ -383,14 +969,9 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			// }
 			//
 
-			auto dest = it.block->next[0]->entry_vip;
-
 			// Jump to next block.
 			//
-			state->cc.jmp(state->get_label(dest));
-
-			if (!state->is_compiled.count(dest))
-				compile(it.block->next[0], state);
+			state->jump_to(it.block->next[0]->entry_vip);
 		},
 	},
 	{
@@ -399,14 +980,17 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			auto dest = it->operands[0].reg();
 			auto shift = it->operands[1];
 
+			// Variable shift counts are taken from cl
+			//
 			if (shift.is_immediate())
 			{
 				state->cc.shl(state->get_reg(dest), shift.imm().ival);
 			}
 			else
 			{
-				state->cc.shl(state->get_reg(dest), state->get_reg(shift.reg()));
+				state->cc.shl(state->get_reg(dest), state->get_reg(shift.reg()).r8());
 			}
+			state->truncate(dest);
 		},
 	},
 	{
@@ -415,14 +999,17 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			auto dest = it->operands[0].reg();
 			auto shift = it->operands[1];
 
+			// Variable shift counts are taken from cl
+			//
 			if (shift.is_immediate())
 			{
 				state->cc.shr(state->get_reg(dest), shift.imm().ival);
 			}
 			else
 			{
-				state->cc.shr(state->get_reg(dest), state->get_reg(shift.reg()));
+				state->cc.shr(state->get_reg(dest), state->get_reg(shift.reg()).r8());
 			}
+			state->truncate(dest);
 		},
 	},
 	{
@@ -431,14 +1018,7 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			auto dest = it->operands[0].reg();
 			auto bit = it->operands[1];
 
-			if (bit.is_immediate())
-			{
-				state->cc.and_(state->get_reg(dest), state->tmp_imm(bit));
-			}
-			else
-			{
-				state->cc.and_(state->get_reg(dest), state->get_reg(bit.reg()));
-			}
+			state->emit_binary(x86::Inst::kIdAnd, state->get_reg(dest), bit);
 		},
 	},
 	{
@@ -447,21 +1027,7 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			auto lhs = it->operands[0].reg();
 			auto rhs = it->operands[1];
 
-			if (rhs.is_immediate())
-			{
-				if (rhs.imm().bit_count > 32 || rhs.imm().ival > 0x7FFFFFFF)
-				{
-					auto temp_reg = state->cc.newGpq();
-					state->cc.mov(temp_reg, rhs.imm().ival);
-					state->cc.or_(state->get_reg(lhs), temp_reg);
-				}					
-				else
-					state->cc.or_(state->get_reg(lhs), rhs.imm().ival);
-			}
-			else
-			{
-				state->cc.or_(state->get_reg(lhs), state->get_reg(rhs.reg()));
-			}
+			state->emit_binary(x86::Inst::kIdOr, state->get_reg(lhs), rhs);
 		},
 	},
 	{
@@ -470,26 +1036,22 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			auto lhs = it->operands[0].reg();
 			auto rhs = it->operands[1];
 
-			if (rhs.is_immediate())
-			{
-				state->cc.xor_(state->get_reg(lhs), rhs.imm().ival);
-			}
-			else
-			{
-				state->cc.xor_(state->get_reg(lhs), state->get_reg(rhs.reg()));
-			}
+			state->emit_binary(x86::Inst::kIdXor, state->get_reg(lhs), rhs);
+			state->truncate(lhs);
 		},
 	},
 	{
 		ins::bnot,
 		[](const vtil::il_iterator& it, routine_state* state) {
 			state->cc.not_(state->get_reg(it->operands[0].reg()));
+			state->truncate(it->operands[0].reg());
 		},
 	},
 	{
 		ins::neg,
 		[](const vtil::il_iterator& it, routine_state* state) {
 			state->cc.neg(state->get_reg(it->operands[0].reg()));
+			state->truncate(it->operands[0].reg());
 		},
 	},
 	{
@@ -502,46 +1064,22 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			state->cc.embedUInt8((uint8_t)data);
 		},
 	},
-#define MAP_CONDITIONAL(instrT, opcode, ropcode)                                    \
-	{                                                                               \
-		ins::instrT, [](const vtil::il_iterator& instr, routine_state* state) {     \
-			vtil::logger::log("1_is_imm: %d\n", instr->operands[0].is_immediate()); \
-			vtil::logger::log("2_is_imm: %d\n", instr->operands[1].is_immediate()); \
-			vtil::logger::log("3_is_imm: %d\n", instr->operands[2].is_immediate()); \
-			if (instr->operands[1].is_immediate())                                  \
-			{                                                                       \
-				x86::Gp tmp = state->reg_for_size(instr->operands[1]);              \
-				state->cc.mov(tmp, instr->operands[1].imm().ival);                   \
-				state->cc.cmp(state->get_reg(instr->operands[2].reg()), tmp);       \
-				state->cc.ropcode(state->get_reg(instr->operands[0].reg()));        \
-			}                                                                       \
-			else                                                                    \
-			{                                                                       \
-				if (instr->operands[2].is_immediate())                              \
-				{                                                                   \
-					x86::Gp tmp = state->reg_for_size(instr->operands[2]);          \
-					state->cc.mov(tmp, instr->operands[2].imm().ival);               \
-					state->cc.cmp(state->get_reg(instr->operands[1].reg()), tmp);   \
-				}                                                                   \
-				else                                                                \
-				{                                                                   \
-					state->cc.cmp(state->get_reg(instr->operands[1].reg()),         \
-						state->get_reg(instr->operands[2].reg()));                  \
-				}                                                                   \
-				state->cc.ropcode(state->get_reg(instr->operands[0].reg()));        \
-			}                                                                       \
-		},                                                                          \
-	}
-	MAP_CONDITIONAL(tg, setg, setle),
-	MAP_CONDITIONAL(tge, setge, setl),
-	MAP_CONDITIONAL(te, sete, setne),
-	MAP_CONDITIONAL(tne, setne, sete),
-	MAP_CONDITIONAL(tle, setle, setg),
-	MAP_CONDITIONAL(tl, setl, setge),
-	MAP_CONDITIONAL(tug, seta, setbe),
-	MAP_CONDITIONAL(tuge, setae, setb),
-	MAP_CONDITIONAL(tule, setbe, seta),
-	MAP_CONDITIONAL(tul, setb, setae),
+#define MAP_CONDITIONAL(instrT, cond, swapped)                                  \
+	{                                                                           \
+		ins::instrT, [](const vtil::il_iterator& instr, routine_state* state) { \
+			emit_conditional(instr, state, cond, swapped);                      \
+		},                                                                      \
+	}
+	MAP_CONDITIONAL(tg, x86::Condition::kG, x86::Condition::kL),
+	MAP_CONDITIONAL(tge, x86::Condition::kGE, x86::Condition::kLE),
+	MAP_CONDITIONAL(te, x86::Condition::kE, x86::Condition::kE),
+	MAP_CONDITIONAL(tne, x86::Condition::kNE, x86::Condition::kNE),
+	MAP_CONDITIONAL(tle, x86::Condition::kLE, x86::Condition::kGE),
+	MAP_CONDITIONAL(tl, x86::Condition::kL, x86::Condition::kG),
+	MAP_CONDITIONAL(tug, x86::Condition::kA, x86::Condition::kB),
+	MAP_CONDITIONAL(tuge, x86::Condition::kAE, x86::Condition::kBE),
+	MAP_CONDITIONAL(tule, x86::Condition::kBE, x86::Condition::kAE),
+	MAP_CONDITIONAL(tul, x86::Condition::kB, x86::Condition::kA),
 #undef MAP_CONDITIONAL
 	{
 		ins::ifs,
@@ -550,54 +1088,730 @@ static const std::map<vtil::instruction_desc, fn_instruction_compiler_t> handler
 			auto cc = it->operands[1];
 			auto res = it->operands[2];
 
-			state->cc.xor_(state->get_reg(dest), state->get_reg(dest));
 			// TODO: CC can be an immediate, how does that work?
 			//
-			state->cc.test(state->get_reg(cc.reg()), state->get_reg(cc.reg()));
+			uint32_t condition = state->condition_of(cc.reg());
+
+			x86::Gp dst = state->get_reg(dest);
+			vtil::bitcnt_t bits = std::max<vtil::bitcnt_t>(dest.bit_count, 32);
 
+			// cmov has neither an immediate nor an 8-bit form
+			//
+			x86::Gp value;
 			if (res.is_immediate())
 			{
-				x86::Gp tmp = state->reg_for_size(res);
-				state->cc.mov(tmp, res.imm().ival);
-				state->cc.cmovnz(state->get_reg(dest), tmp);
+				int64_t imm = res.imm().ival;
+				if (dest.bit_count < 64)
+					imm &= (1ll << dest.bit_count) - 1;
+				value = sized_view(state->materialize(imm), bits);
+			}
+			else if (!(res.reg() == dest) || dest.bit_count < 32)
+			{
+				value = state->get_reg_as(res.reg(), bits);
+			}
+
+			// Results are cleared with mov rather than xor so the tested flags survive for the cmov and for
+			// later instructions testing the same condition
+			//
+			if (dest.bit_count < 32)
+			{
+				// Narrow results are selected in a 32-bit register and then moved into place
+				//
+				x86::Gp select = state->cc.newGpd();
+				state->cc.mov(select, 0);
+				state->cc.emit(x86::Inst::cmovccFromCond(condition), select, value);
+				state->cc.mov(dst, sized_view(select, dest.bit_count));
+			}
+			else if (!value.isValid())
+			{
+				state->cc.emit(x86::Inst::cmovccFromCond(x86::Condition::negate(condition)), dst, sized_view(state->materialize(0), bits));
 			}
 			else
 			{
-				state->cc.cmovnz(state->get_reg(dest), state->get_reg(res.reg()));
+				state->cc.mov(dst, 0);
+				state->cc.emit(x86::Inst::cmovccFromCond(condition), dst, value);
 			}
 		},
+		true,
 	},
 	{ ins::vpinr, [](const vtil::il_iterator& it, routine_state* state)
 		{
-		} },
+		},
+		true },
 	{ ins::vpinw, [](const vtil::il_iterator& it, routine_state* state)
 		{
-		} },
+		},
+		true },
 	{ ins::vpinrm, [](const vtil::il_iterator& it, routine_state* state)
 		{
-		} },
+		},
+		true },
 	{ ins::vpinwm, [](const vtil::il_iterator& it, routine_state* state)
 		{
-		} },
+		},
+		true },
 };
 
+static constexpr size_t invalid_handler = std::size(handler_table);
+
+// Resolves instruction descriptors to their index in handler_table. Instructions point into a small set
+// of static descriptors, so each descriptor address is compared against the table only once and then
+// served from a direct-mapped, linearly probed cache, which fails once it holds `capacity` descriptors.
+//
+struct descriptor_index
+{
+	static constexpr size_t capacity = 256;
+	static_assert(capacity > 2 * std::size(handler_table));
+
+	std::array<const vtil::instruction_desc*, capacity> keys = {};
+	std::array<uint8_t, capacity> values = {};
+
+	size_t resolve(const vtil::instruction_desc* desc)
+	{
+		size_t slot = (uintptr_t(desc) >> 4) % capacity;
+		for (size_t probe = 0; probe != capacity; probe++, slot = (slot + 1) % capacity)
+		{
+			if (keys[slot] == desc)
+				return values[slot];
+
+			if (!keys[slot])
+			{
+				size_t index = 0;
+				while (index != invalid_handler && !(handler_table[index].desc == *desc))
+					index++;
+
+				keys[slot] = desc;
+				values[slot] = uint8_t(index);
+				return index;
+			}
+		}
+		fatal("More than %d distinct instruction descriptors", int(capacity));
+	}
+};
+
+static size_t handler_index(const vtil::instruction_desc* desc)
+{
+	thread_local descriptor_index index;
+	return index.resolve(desc);
+}
+
+bool can_compile(const vtil::instruction_desc& desc)
+{
+	return handler_index(&desc) != invalid_handler;
+}
+
 static void compile(vtil::basic_block* basic_block, routine_state* state)
 {
 	Label L_entry = state->get_label(basic_block->entry_vip);
 	state->cc.bind(L_entry);
-	state->is_compiled.insert(basic_block->entry_vip);
+	state->begin_block();
 
 	for (auto it = basic_block->begin(); !it.is_end(); it++)
 	{
-		vtil::debug::dump(*it);
-		auto handler = handler_table.find(*it->base);
-		if (handler == handler_table.end())
+		if (trace_enabled())
+			vtil::debug::dump(*it);
+		if (state->dead_flag_writes.count(&*it))
+		{
+			LOG_TRACE("\tskipped, writes dead flags only\n");
+			continue;
+		}
+		auto index = handler_index(it->base);
+		if (index == invalid_handler)
+			fatal("Unrecognized instruction '%s'", it->base->name);
+
+		const instruction_handler& handler = handler_table[index];
+		if (!handler.preserves_flags)
+			state->flags.reset();
+		state->bind_operands(*it);
+		handler.compile(it, state);
+		state->commit_operands();
+
+		// Writing the register the flags describe makes them stale even if they survived. Handlers that do
+		// not preserve the flags have already set them up for their own result.
+		//
+		if (handler.preserves_flags && state->flags)
+		{
+			for (size_t i = 0; i < it->operands.size(); i++)
+			{
+				if (it->base->operand_types[i] >= vtil::operand_type::write && it->operands[i].is_register() && it->operands[i].reg().overlaps(state->flags->reg))
+					state->flags.reset();
+			}
+		}
+	}
+}
+
+// Bits of the flags register a register operand covers, zero for any other register
+//
+static uint64_t flag_bits(const vtil::register_desc& reg)
+{
+	if (!reg.is_flags())
+		return 0;
+	return reg.bit_count >= 64 ? ~0ull : ((1ull << reg.bit_count) - 1) << reg.bit_offset;
+}
+
+struct flag_access
+{
+	uint64_t read = 0;
+	uint64_t written = 0;
+
+	// Branches, stores and writes to anything but the flags keep the instruction alive regardless
+	//
+	bool other_effects = false;
+};
+
+static flag_access flag_accesses(const vtil::instruction& instr)
+{
+	flag_access access;
+	access.other_effects = instr.base->is_branching() || instr.base->writes_memory() || instr.is_volatile();
+	for (size_t i = 0; i < instr.operands.size(); i++)
+	{
+		if (!instr.operands[i].is_register())
+			continue;
+
+		uint64_t bits = flag_bits(instr.operands[i].reg());
+		auto type = instr.base->operand_types[i];
+		if (type >= vtil::operand_type::write)
+		{
+			if (bits)
+				access.written |= bits;
+			else
+				access.other_effects = true;
+		}
+		if (type != vtil::operand_type::write)
+			access.read |= bits;
+	}
+	return access;
+}
+
+// Backward liveness of the individual flag bits over the whole routine. Lifted code computes every flag an
+// instruction defines, most of which are overwritten before anything reads them. The calling convention
+// does not preserve the flags, so nothing is live past a vexit. Blocks without known successors keep
+// every flag live.
+//
+static std::unordered_set<const vtil::instruction*> find_dead_flag_writes(vtil::routine* rtn)
+{
+	std::unordered_map<const vtil::basic_block*, uint64_t> live_in;
+
+	auto live_out = [&](const vtil::basic_block* block) -> uint64_t {
+		if (block->empty())
+			return ~0ull;
+		if (*block->back().base == ins::vexit)
+			return 0;
+		if (block->next.empty())
+			return ~0ull;
+
+		uint64_t live = 0;
+		for (const vtil::basic_block* successor : block->next)
+		{
+			auto it = live_in.find(successor);
+			if (it != live_in.end())
+				live |= it->second;
+		}
+		return live;
+	};
+
+	// Runs the block backwards from its live-out set, reporting every dead write to `dead`
+	//
+	auto transfer = [&](vtil::basic_block* block, std::unordered_set<const vtil::instruction*>* dead) {
+		uint64_t live = live_out(block);
+		for (auto it = block->end(); it != block->begin();)
+		{
+			--it;
+			flag_access access = flag_accesses(*it);
+			if (access.written && !access.other_effects && !(access.written & live))
+			{
+				if (dead)
+					dead->insert(&*it);
+				continue;
+			}
+			live = (live & ~access.written) | access.read;
+		}
+		return live;
+	};
+
+	// Live sets only grow from the empty start, so this reaches a fixed point
+	//
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (auto& [vip, block] : rtn->explored_blocks)
 		{
-			vtil::logger::log("\n[!] ERROR: Unrecognized instruction '%s'\n\n", it->base->name);
-			exit(1);
+			uint64_t live = transfer(block, nullptr);
+			auto& entry = live_in[block];
+			if (entry != live)
+			{
+				entry = live;
+				changed = true;
+			}
+		}
+	}
+
+	std::unordered_set<const vtil::instruction*> dead;
+	for (auto& [vip, block] : rtn->explored_blocks)
+		transfer(block, &dead);
+	return dead;
+}
+
+// Highest bit accessed of every register, see routine_state::extents
+//
+static std::unordered_map<register_key, vtil::bitcnt_t, register_key_hash> register_extents(vtil::routine* rtn)
+{
+	std::unordered_map<register_key, vtil::bitcnt_t, register_key_hash> extents;
+	for (auto& [vip, block] : rtn->explored_blocks)
+	{
+		for (const vtil::instruction& instr : *block)
+		{
+			for (const vtil::operand& op : instr.operands)
+			{
+				if (!op.is_register())
+					continue;
+				auto& extent = extents[register_key(op.reg())];
+				extent = std::max<vtil::bitcnt_t>(extent, op.reg().bit_offset + op.reg().bit_count);
+			}
+		}
+	}
+	return extents;
+}
+
+// Successor that should be placed right after the block so its branch can fall through
+//
+static vtil::basic_block* fallthrough_successor(vtil::basic_block* block, const std::unordered_set<vtil::basic_block*>& placed)
+{
+	if (block->empty())
+		return nullptr;
+
+	auto find_successor = [&](vtil::vip_t address) -> vtil::basic_block* {
+		for (vtil::basic_block* successor : block->next)
+		{
+			if (successor->entry_vip == address && !placed.count(successor))
+				return successor;
+		}
+		return nullptr;
+	};
+
+	const vtil::instruction& branch = block->back();
+	if (*branch.base == ins::js)
+	{
+		// Prefer the not-taken path, the taken path also falls through with an inverted condition
+		//
+		if (auto successor = find_successor(branch.operands[2].imm().uval))
+			return successor;
+		return find_successor(branch.operands[1].imm().uval);
+	}
+	if ((*branch.base == ins::jmp && branch.operands[0].is_immediate()) || *branch.base == ins::vxcall)
+	{
+		if (!block->next.empty() && !placed.count(block->next[0]))
+			return block->next[0];
+	}
+	return nullptr;
+}
+
+// Orders the reachable blocks so that chains of fall-through successors are contiguous. Blocks are
+// discovered with an explicit worklist, so deep control flow graphs do not recurse.
+//
+static std::vector<vtil::basic_block*> layout_blocks(vtil::basic_block* entry)
+{
+	std::vector<vtil::basic_block*> order;
+	std::unordered_set<vtil::basic_block*> placed;
+	std::vector<vtil::basic_block*> worklist = { entry };
+
+	while (!worklist.empty())
+	{
+		vtil::basic_block* block = worklist.back();
+		worklist.pop_back();
+
+		while (block && placed.insert(block).second)
+		{
+			order.push_back(block);
+			vtil::basic_block* successor = fallthrough_successor(block, placed);
+
+			// Remaining successors are pushed in reverse so they are laid out in their original order
+			//
+			for (auto it = block->next.rbegin(); it != block->next.rend(); ++it)
+			{
+				if (*it != successor && !placed.count(*it))
+					worklist.push_back(*it);
+			}
+			block = successor;
 		}
-		handler->second(it, state);
 	}
+	return order;
+}
+
+static void compile_blocks(vtil::routine* rtn, routine_state* state)
+{
+	auto order = layout_blocks(rtn->entry_point);
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		state->next_block = i + 1 < order.size() ? order[i + 1] : nullptr;
+		compile(order[i], state);
+	}
+}
+
+// Post-selection peephole optimizer
+//
+// Runs over the compiler's node list after every VTIL instruction has been selected and before register
+// allocation. Selection works one instruction at a time, the rules clean up what it leaves at the seams.
+// Control only enters the code at a label through a jump whose block starts from a clean flags state,
+// see routine_state::begin_block, so the flags are never live into a label.
+//
+
+std::atomic<bool> peephole_enabled = true;
+
+// Conditional instruction ids mapped to the condition they read
+//
+struct condition_readers
+{
+	std::unordered_map<uint32_t, uint32_t> conditions;
+
+	condition_readers()
+	{
+		for (uint32_t cond = 0; cond < 16; cond++)
+		{
+			conditions[x86::Inst::jccFromCond(cond)] = cond;
+			conditions[x86::Inst::setccFromCond(cond)] = cond;
+			conditions[x86::Inst::cmovccFromCond(cond)] = cond;
+		}
+	}
+};
+
+static const condition_readers& readers()
+{
+	static condition_readers instance;
+	return instance;
+}
+
+// How the flags are used after a node, up to the next instruction that overwrites all of them
+//
+enum class flags_use
+{
+	dead,
+	zero_sign_only,
+	other,
+};
+
+static bool writes_all_flags(uint32_t id)
+{
+	switch (id)
+	{
+	case x86::Inst::kIdAdd:
+	case x86::Inst::kIdSub:
+	case x86::Inst::kIdAnd:
+	case x86::Inst::kIdOr:
+	case x86::Inst::kIdXor:
+	case x86::Inst::kIdCmp:
+	case x86::Inst::kIdTest:
+	case x86::Inst::kIdNeg:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool preserves_all_flags(uint32_t id)
+{
+	switch (id)
+	{
+	case x86::Inst::kIdMov:
+	case x86::Inst::kIdMovzx:
+	case x86::Inst::kIdMovsx:
+	case x86::Inst::kIdMovsxd:
+	case x86::Inst::kIdLea:
+	case x86::Inst::kIdNot:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static flags_use next_flags_use(BaseNode* node)
+{
+	flags_use use = flags_use::dead;
+	for (node = node->next(); node; node = node->next())
+	{
+		if (node->type() == BaseNode::kNodeLabel || node->type() == BaseNode::kNodeFuncRet || node->type() == BaseNode::kNodeSentinel)
+			return use;
+		if (!node->isInst())
+			return flags_use::other;
+
+		uint32_t id = node->as<InstNode>()->id();
+		auto reader = readers().conditions.find(id);
+		if (reader != readers().conditions.end())
+		{
+			uint32_t cond = reader->second;
+			if (cond != x86::Condition::kZ && cond != x86::Condition::kNZ && cond != x86::Condition::kS && cond != x86::Condition::kNS)
+				return flags_use::other;
+			use = flags_use::zero_sign_only;
+		}
+		else if (writes_all_flags(id) || id == x86::Inst::kIdJmp || id == x86::Inst::kIdUd2 || id == x86::Inst::kIdRet)
+		{
+			return use;
+		}
+		else if (!preserves_all_flags(id))
+		{
+			return flags_use::other;
+		}
+	}
+	return use;
+}
+
+static InstNode* as_inst(BaseNode* node)
+{
+	return node && node->isInst() ? node->as<InstNode>() : nullptr;
+}
+
+// Virtual register operands are counted once per occurrence, including memory bases and indices
+//
+using use_counts = std::unordered_map<uint32_t, uint32_t>;
+
+static use_counts count_uses(x86::Compiler& cc)
+{
+	use_counts uses;
+	for (BaseNode* node = cc.firstNode(); node; node = node->next())
+	{
+		if (!node->isInst())
+			continue;
+
+		InstNode* inst = node->as<InstNode>();
+		for (uint32_t i = 0; i < inst->opCount(); i++)
+		{
+			const Operand& op = inst->op(i);
+			if (op.isReg())
+				uses[op.id()]++;
+			else if (op.isMem())
+			{
+				const BaseMem& mem = op.as<BaseMem>();
+				if (mem.hasBaseReg())
+					uses[mem.baseId()]++;
+				if (mem.hasIndexReg())
+					uses[mem.indexId()]++;
+			}
+		}
+	}
+	return uses;
+}
+
+struct peephole_rule
+{
+	const char* name;
+
+	// Rewrites the code at the node, returns the node to continue from or the node itself if nothing
+	// matched
+	BaseNode* (*apply)(x86::Compiler& cc, InstNode* inst, const use_counts& uses);
+
+	std::atomic<size_t> hits = 0;
+};
+
+// `jmp L` directly followed by `L:`, possibly among other labels
+//
+static BaseNode* rule_jump_to_next(x86::Compiler& cc, InstNode* inst, const use_counts&)
+{
+	if (inst->id() != x86::Inst::kIdJmp || inst->opCount() != 1 || !inst->op(0).isLabel())
+		return inst;
+
+	uint32_t target = inst->op(0).id();
+	for (BaseNode* node = inst->next(); node && node->type() == BaseNode::kNodeLabel; node = node->next())
+	{
+		if (node->as<LabelNode>()->labelId() == target)
+		{
+			BaseNode* next = inst->next();
+			cc.removeNode(inst);
+			return next;
+		}
+	}
+	return inst;
+}
+
+// `test r, r` right after an ALU instruction that already set ZF and SF from r, when nothing reads any
+// other flag
+//
+static BaseNode* rule_redundant_test(x86::Compiler& cc, InstNode* inst, const use_counts&)
+{
+	if (inst->id() != x86::Inst::kIdTest || inst->opCount() != 2 || !inst->op(0).isReg() || inst->op(0) != inst->op(1))
+		return inst;
+
+	InstNode* prev = as_inst(inst->prev());
+	if (!prev || !writes_all_flags(prev->id()) || prev->id() == x86::Inst::kIdCmp || prev->id() == x86::Inst::kIdTest)
+		return inst;
+	if (prev->opCount() < 1 || prev->op(0) != inst->op(0))
+		return inst;
+	if (next_flags_use(inst) == flags_use::other)
+		return inst;
+
+	BaseNode* next = inst->next();
+	cc.removeNode(inst);
+	return next;
+}
+
+// `mov r, 0` becomes the shorter `xor r32, r32` when the flags it clobbers are dead
+//
+static BaseNode* rule_zero_idiom(x86::Compiler&, InstNode* inst, const use_counts&)
+{
+	if (inst->id() != x86::Inst::kIdMov || inst->opCount() != 2 || !inst->op(0).isReg() || !inst->op(1).isImm())
+		return inst;
+
+	const x86::Gp& reg = inst->op(0).as<x86::Gp>();
+	if (inst->op(1).as<Imm>().value() != 0 || reg.size() < 4)
+		return inst;
+	if (next_flags_use(inst) != flags_use::dead)
+		return inst;
+
+	inst->setId(x86::Inst::kIdXor);
+	inst->setOp(0, reg.r32());
+	inst->setOp(1, reg.r32());
+	return inst->next();
+}
+
+// `mov t, imm` whose register has exactly one other use, as the source of an instruction that takes an
+// imm32 directly
+//
+static BaseNode* rule_fold_constant(x86::Compiler& cc, InstNode* inst, const use_counts& uses)
+{
+	if (inst->id() != x86::Inst::kIdMov || inst->opCount() != 2 || !inst->op(0).isReg() || !inst->op(1).isImm())
+		return inst;
+
+	const Operand& tmp = inst->op(0);
+	int64_t value = inst->op(1).as<Imm>().value();
+	if (!Operand::isVirtId(tmp.id()) || !Support::isInt32(value))
+		return inst;
+
+	auto count = uses.find(tmp.id());
+	if (count == uses.end() || count->second != 2)
+		return inst;
+
+	for (BaseNode* node = inst->next(); node && node->type() != BaseNode::kNodeLabel; node = node->next())
+	{
+		InstNode* use = as_inst(node);
+		if (!use)
+			return inst;
+
+		for (uint32_t i = 0; i < use->opCount(); i++)
+		{
+			if (!(use->op(i).isReg() && use->op(i).id() == tmp.id()) && !(use->op(i).isMem() && (use->op(i).as<BaseMem>().baseId() == tmp.id() || use->op(i).as<BaseMem>().indexId() == tmp.id())))
+				continue;
+
+			switch (use->id())
+			{
+			case x86::Inst::kIdAdd:
+			case x86::Inst::kIdSub:
+			case x86::Inst::kIdAnd:
+			case x86::Inst::kIdOr:
+			case x86::Inst::kIdXor:
+			case x86::Inst::kIdCmp:
+			case x86::Inst::kIdMov:
+				break;
+			default:
+				return inst;
+			}
+			if (i != 1 || use->opCount() != 2 || !use->op(0).isReg() || !use->op(1).isReg() || use->op(0).id() == tmp.id())
+				return inst;
+
+			// A different view would change how the constant is extended
+			if (use->op(1).as<x86::Gp>().size() != tmp.as<x86::Gp>().size())
+				return inst;
+
+			use->setOp(1, Imm(value));
+			BaseNode* next = inst->next();
+			cc.removeNode(inst);
+			return next;
+		}
+	}
+	return inst;
+}
+
+static peephole_rule peephole_rules[] = {
+	{ "jump_to_next", rule_jump_to_next },
+	{ "redundant_test", rule_redundant_test },
+	{ "fold_constant", rule_fold_constant },
+	{ "zero_idiom", rule_zero_idiom },
+};
+
+// Applies the first matching rule at every instruction, rules that rewrite continue after the rewritten
+// code so each instruction is visited once
+//
+static void run_peephole(x86::Compiler& cc)
+{
+	use_counts uses = count_uses(cc);
+	for (BaseNode* node = cc.firstNode(); node;)
+	{
+		InstNode* inst = as_inst(node);
+		if (!inst)
+		{
+			node = node->next();
+			continue;
+		}
+
+		BaseNode* next = inst->next();
+		for (auto& rule : peephole_rules)
+		{
+			BaseNode* result = rule.apply(cc, inst, uses);
+			if (result != inst)
+			{
+				rule.hits++;
+				next = result;
+				break;
+			}
+		}
+		node = next;
+	}
+}
+
+void report_peephole()
+{
+	std::string hits;
+	for (auto& rule : peephole_rules)
+		hits += vtil::format::str("%s%s %llu", hits.empty() ? "" : ", ", rule.name, rule.hits.load());
+	log_at(verbosity_level::normal, "[*] Peephole: %s\n", hits);
+}
+
+void compile_routine(vtil::routine* rtn, CodeHolder& code)
+{
+	x86::Compiler cc(&code);
+	compile_routine(rtn, cc);
+}
+
+std::atomic<bool> narrow_registers_enabled = true;
+
+void compile_routine(vtil::routine* rtn, x86::Compiler& cc)
+{
+	cc.addFunc(FuncSignatureT<void>());
+
+	//TODO is that info available in the .VTIL file?
+	//
+	routine_state state(cc, default_jit_image_base);
+	state.dead_flag_writes = find_dead_flag_writes(rtn);
+	state.narrow = narrow_registers_enabled;
+	if (state.narrow)
+		state.extents = register_extents(rtn);
+	compile_blocks(rtn, &state);
+
+	cc.endFunc();
+	state.emit_jump_tables();
+	if (peephole_enabled)
+		run_peephole(cc);
+	cc.finalize();
+}
+
+jit_context::jit_context(const Environment& environment)
+	: environment(environment)
+{
+}
+
+std::vector<uint8_t> jit_context::compile(vtil::routine* rtn)
+{
+	// Resetting detaches the compiler, which releases its zones for reuse
+	//
+	code.reset();
+	code.init(environment);
+	code.setErrorHandler(&error_handler);
+	if (logger)
+		code.setLogger(logger);
+	code.attach(&cc);
+
+	compile_routine(rtn, cc);
+
+	CodeBuffer& buffer = code.sectionById(0)->buffer();
+	return { buffer.data(), buffer.data() + buffer.size() };
 }
 
 class DemoErrorHandler : public ErrorHandler
@@ -609,48 +1823,305 @@ public:
 	}
 };
 
+// Counts the instructions the assembler emits, labels, directives and comments in the listing are skipped
+//
+class instruction_counter : public Logger
+{
+public:
+	size_t instructions = 0;
+
+	Error _log(const char* data, size_t size) noexcept override
+	{
+		std::string_view text(data, size == SIZE_MAX ? strlen(data) : size);
+		while (!text.empty())
+		{
+			size_t end = std::min(text.find('\n'), text.size());
+			std::string_view line = text.substr(0, end);
+			text.remove_prefix(std::min(end + 1, text.size()));
+
+			size_t start = line.find_first_not_of(" \t");
+			if (start == std::string_view::npos)
+				continue;
+			line.remove_prefix(start);
+			if (line.front() != '.' && line.front() != ';' && line.back() != ':')
+				instructions++;
+		}
+		return kErrorOk;
+	}
+};
+
+// Compiles the routine repeatedly and reports dispatch and compile throughput. The dispatch figures compare
+// the dense handler index against the ordered descriptor map the compiler used to look handlers up with.
+//
+static void benchmark_compile(vtil::routine* rtn, size_t iterations)
+{
+	using clock = std::chrono::steady_clock;
+	using vtil::logger::log;
+
+	std::vector<const vtil::instruction_desc*> stream;
+	for (auto& [vip, block] : rtn->explored_blocks)
+	{
+		for (auto it = block->begin(); !it.is_end(); it++)
+			stream.push_back(it->base);
+	}
+	if (stream.empty())
+		return;
+
+	std::map<vtil::instruction_desc, size_t> map_table;
+	for (size_t i = 0; i < std::size(handler_table); i++)
+		map_table.emplace(handler_table[i].desc, i);
+
+	// Repeat the lookups enough times to get a stable measurement even on small routines
+	//
+	size_t lookups = std::max<size_t>(iterations * stream.size(), 1'000'000);
+	size_t checksum = 0;
+
+	auto t0 = clock::now();
+	for (size_t i = 0; i < lookups; i++)
+		checksum += map_table.find(*stream[i % stream.size()])->second;
+	double map_seconds = std::chrono::duration<double>(clock::now() - t0).count();
+
+	t0 = clock::now();
+	for (size_t i = 0; i < lookups; i++)
+		checksum -= handler_index(stream[i % stream.size()]);
+	double dense_seconds = std::chrono::duration<double>(clock::now() - t0).count();
+
+	log("[*] Dispatch: map %.2fM lookups/s, dense table %.2fM lookups/s (checksum %llu)\n",
+		lookups / map_seconds / 1e6, lookups / dense_seconds / 1e6, checksum);
+
+	// End to end compilation without any logging attached
+	//
+	vtil::logger::scope_verbosity verbosity(false);
+	JitRuntime rt;
+	DemoErrorHandler errorHandler;
+
+	t0 = clock::now();
+	for (size_t i = 0; i < iterations; i++)
+	{
+		CodeHolder code;
+		code.init(rt.environment());
+		code.setErrorHandler(&errorHandler);
+		compile_routine(rtn, code);
+	}
+	double compile_seconds = std::chrono::duration<double>(clock::now() - t0).count();
+
+	log("[*] Compile: %llu iterations of %llu instructions in %.2fms, %.2f instructions/s\n",
+		iterations, stream.size(), compile_seconds * 1000, iterations * stream.size() / compile_seconds);
+
+	// Code size with and without the peephole pass
+	//
+	auto code_size = [&](bool peephole) {
+		bool enabled = peephole_enabled.exchange(peephole);
+		instruction_counter counter;
+		CodeHolder code;
+		code.init(rt.environment());
+		code.setErrorHandler(&errorHandler);
+		code.setLogger(&counter);
+		compile_routine(rtn, code);
+		peephole_enabled = enabled;
+		return std::make_pair(code.codeSize(), counter.instructions);
+	};
+	auto [without, without_instructions] = code_size(false);
+	auto [with, with_instructions] = code_size(true);
+	log("[*] Code size: %llu bytes, %llu instructions without peephole, %llu bytes, %llu instructions with peephole (%.1f%% smaller)\n",
+		without, without_instructions, with, with_instructions, without ? 100.0 * (double(without) - double(with)) / without : 0.0);
+}
+
+struct compile_result
+{
+	std::filesystem::path input;
+	bool success = false;
+	std::string error;
+	size_t instructions = 0;
+	size_t bytes = 0;
+	double milliseconds = 0;
+	bool cached = false;
+};
+
+// Everything besides the input and the tool version that determines the compiled bytes, the revision is
+// bumped whenever code generation changes
+static constexpr int compiler_revision = 7;
+
+static std::string compile_cache_config(const Environment& environment)
+{
+	return vtil::format::str("compile:%d:r%d%s%s", int(environment.arch()), compiler_revision, peephole_enabled ? "" : ":no-peephole",
+		narrow_registers_enabled ? "" : ":wide-registers");
+}
+
+static void compile_batch(const std::vector<std::filesystem::path>& inputs, const std::filesystem::path& root, const std::filesystem::path& output, size_t jobs, artifact_cache* cache)
+{
+	using vtil::logger::log;
+	namespace fs = std::filesystem;
+
+	JitRuntime rt;
+	Environment environment = rt.environment();
+	std::vector<compile_result> results(inputs.size());
+	auto relative = batch_relative_paths(inputs, root);
+
+	auto start = std::chrono::steady_clock::now();
+	parallel_for(inputs.size(), jobs, [&](size_t index) {
+		// Each worker thread keeps its own compilation context across routines
+		//
+		thread_local std::unique_ptr<jit_context> context;
+		if (!context)
+			context = std::make_unique<jit_context>(environment);
+
+		auto& result = results[index];
+		result.input = inputs[index];
+
+		auto t0 = std::chrono::steady_clock::now();
+		try
+		{
+			std::string key;
+			std::optional<std::vector<uint8_t>> bytes;
+			if (cache)
+			{
+				key = artifact_cache::make_key(read_file_bytes(result.input), compile_cache_config(environment));
+				bytes = cache->get(key);
+				result.cached = bytes.has_value();
+			}
+
+			if (!bytes)
+			{
+				std::unique_ptr<vtil::routine> rtn{ vtil::load_routine(result.input) };
+				result.instructions = rtn->num_instructions();
+				bytes = context->compile(rtn.get());
+				if (cache)
+					cache->put(key, *bytes);
+			}
+			result.bytes = bytes->size();
+			result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+			auto destination = output / fs::path(relative[index]).replace_extension("bin");
+			fs::create_directories(destination.parent_path());
+			write_file_bytes(destination, *bytes);
+			result.success = true;
+		}
+		catch (const std::exception& e)
+		{
+			result.error = e.what();
+		}
+
+		if (!result.success)
+			log<CON_RED>("%s: %s\n", result.input.string(), result.error);
+		else if (result.cached)
+			log_at(verbosity_level::normal, "%s: cached, %llu bytes (%.2fms)\n", result.input.string(), result.bytes, result.milliseconds);
+		else
+			log_at(verbosity_level::normal, "%s: %llu instructions -> %llu bytes (%.2fms)\n", result.input.string(), result.instructions, result.bytes, result.milliseconds);
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t succeeded = 0, instructions = 0, bytes = 0;
+	for (const auto& result : results)
+	{
+		if (!result.success)
+			continue;
+		succeeded++;
+		instructions += result.instructions;
+		bytes += result.bytes;
+	}
+
+	log_at(verbosity_level::normal, "\n[*] Compiled %llu/%llu routines into %llu bytes in %.2fs using %llu jobs\n", succeeded, results.size(), bytes, seconds, jobs);
+	log_at(verbosity_level::normal, "[*] Throughput: %.2f routines/s, %.2f instructions/s, %.2f KB/s\n",
+		succeeded / seconds, instructions / seconds, bytes / seconds / 1024);
+	if (peephole_enabled)
+		report_peephole();
+	if (cache)
+		cache->report();
+	if (succeeded != results.size())
+		log<CON_RED>("[*] %llu routines failed to compile\n", results.size() - succeeded);
+}
+
 static args::Command command_compile(commands(), "compile", "Compile a .vtil file", [](args::Subparser& parser) {
 	// Argument handling
-	args::Positional<std::string> input(parser, "input", "Input .vtil file", args::Options::Required);	
+	args::Positional<std::string> input(parser, "input", "Input .vtil file, pack.vtilpack:name, or a directory of .vtil files", args::Options::Required);
+	args::ValueFlag<size_t> bench(parser, "iterations", "Compile the routine repeatedly and report throughput instead of writing it", { "bench" });
+	args::Flag asmLog(parser, "asm", "Print the generated assembly (also enabled by -v)", { "asm" });
+	args::ValueFlag<std::string> output(parser, "dir", "Output directory when compiling a directory, defaults to <input>/compiled", { 'o', "output" });
+	args::ValueFlag<size_t> jobs(parser, "jobs", "Number of worker threads when compiling a directory", { 'j', "jobs" }, default_jobs());
+	args::ValueFlag<std::string> cacheDir(parser, "dir", "Reuse compiled code from a content addressed cache directory", { "cache" });
+	args::ValueFlag<uint64_t> cacheSize(parser, "MB", "Maximum size of the cache directory", { "cache-size" }, 1024);
+	args::Flag noPeephole(parser, "no-peephole", "Disable the peephole pass over the selected instructions", { "no-peephole" });
+	args::Flag wideRegisters(parser, "wide-registers", "Lower every register at 64 bits, narrower operands go through a scratch register", { "wide-registers" });
 	parser.Parse();
 
+	peephole_enabled = !noPeephole;
+	narrow_registers_enabled = !wideRegisters;
+
+	std::unique_ptr<artifact_cache> cache;
+	if (cacheDir)
+		cache = std::make_unique<artifact_cache>(cacheDir.Get(), cacheSize.Get() * 1024 * 1024);
+
+	// Batch mode, the input tree layout is mirrored in the output directory
+	//
+	if (std::filesystem::is_directory(input.Get()))
+	{
+		auto inputs = enum_vtil_files(input.Get());
+		if (inputs.empty())
+			fatal("No .vtil files found in '%s'", input.Get());
+
+		auto destination = output ? std::filesystem::path(output.Get()) : std::filesystem::path(input.Get()) / "compiled";
+		compile_batch(inputs, input.Get(), destination, jobs.Get(), cache.get());
+		return;
+	}
+
 	// Command implementation
-	auto rtn = vtil::load_routine(input.Get());
+	auto ref = parse_routine_ref(input.Get());
+	auto rtn = load_routine_ref(ref);
+
+	if (bench)
+	{
+		benchmark_compile(rtn, std::max<size_t>(bench.Get(), 1));
+		return;
+	}
 
 	JitRuntime rt;
 	FileLogger logger(stdout);
 	DemoErrorHandler errorHandler;
 	CodeHolder code;
 
-	code.init(rt.environment());
-	code.setErrorHandler(&errorHandler);
-
-	code.setLogger(&logger);
-	x86::Compiler cc(&code);
-
-	cc.addFunc(FuncSignatureT<void>());
-
-	//TODO is that info available in the .VTIL file?
+	// The assembly listing needs an actual compilation, so a cache hit is only taken without it
 	//
-	routine_state state(cc, 0x180'000'000);
-	compile(rtn->entry_point, &state);
+	bool print_asm = asmLog || is_verbose(verbosity_level::verbose);
+	std::string key;
+	std::optional<std::vector<uint8_t>> bytes;
+	if (cache)
+	{
+		key = artifact_cache::make_key(read_routine_bytes(ref), compile_cache_config(rt.environment()));
+		if (!print_asm)
+			bytes = cache->get(key);
+	}
 
-	cc.endFunc();
-	cc.finalize();
+	if (!bytes)
+	{
+		code.init(rt.environment());
+		code.setErrorHandler(&errorHandler);
 
-	CodeBuffer& buffer = code.sectionById(0)->buffer();
+		if (print_asm)
+			code.setLogger(&logger);
+		compile_routine(rtn, code);
+
+		CodeBuffer& buffer = code.sectionById(0)->buffer();
+		bytes.emplace(buffer.data(), buffer.data() + buffer.size());
+		if (cache)
+			cache->put(key, *bytes);
+		if (peephole_enabled)
+			report_peephole();
+	}
+	if (cache)
+		cache->report();
 
-	std::filesystem::path work_dir = std::filesystem::path(input.Get()).remove_filename() / "compiled/";
+	std::filesystem::path work_dir = std::filesystem::path(ref.file).remove_filename() / "compiled/";
 	std::filesystem::create_directory(work_dir);	
 
 	//Thats a hacky way to do it in general, but it supports supplying commands like vtil.exe compile subfolder/file.vtil
 	//
-	work_dir += std::filesystem::path(input.Get()).replace_extension("bin").filename();
+	work_dir += ref.stem() + ".bin";
 			
 	std::ofstream fs(work_dir, std::ios::binary);
 	if (!fs.is_open())
 		throw std::runtime_error(vtil::format::str("Failed to open bin file '%s'", work_dir));
 
-	fs.write((const char*)buffer.data(), buffer.size());
+	fs.write((const char*)bytes->data(), bytes->size());
 	fs.close();
 });
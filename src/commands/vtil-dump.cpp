@@ -1,4 +1,5 @@
 #include "vtil-utils.hpp"
+#include "vtil_pack.hpp"
 
 using namespace vtil;
 using namespace logger;
@@ -6,10 +7,20 @@ using namespace logger;
 // TODO: add format argument (to print to html)
 static args::Command dump(commands(), "dump", "Dump a .vtil file", [](args::Subparser& parser) {
 	// Argument handling
-	args::Positional<std::string> input(parser, "input", "File to dump", args::Options::Required);
+	args::Positional<std::string> input(parser, "input", "File to dump, pack.vtilpack:name for a packed routine or a .vtilpack file to list its index", args::Options::Required);
 	parser.Parse();
 
 	// Command implementation
-	auto rtn = load_routine(input.Get());
+	auto ref = parse_routine_ref(input.Get());
+	if (!ref.in_pack() && ref.file.extension() == vtil_pack_extension)
+	{
+		vtil_pack pack(ref.file);
+		log("%-48s %8s %12s %10s  %s\n", "name", "blocks", "instructions", "bytes", "sha256");
+		for (const auto& entry : pack.entries())
+			log("%-48s %8u %12u %10llu  %s\n", entry.name, entry.blocks, entry.instructions, entry.size, entry.hash);
+		return;
+	}
+
+	auto rtn = load_routine_ref(ref);
 	debug::dump(rtn);
 });
\ No newline at end of file
@@ -0,0 +1,348 @@
+#include "vtil-utils.hpp"
+#include "jit.hpp"
+
+#include <vtil/vtil>
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+using namespace vtil;
+using namespace logger;
+
+namespace fs = std::filesystem;
+
+struct gen_config
+{
+	size_t blocks = 16;
+	size_t instructions = 32;
+	double branch_density = 0.3;
+	double indirect_density = 0.05;
+	size_t indirect_fan_out = 4;
+	bool dense_indirect = false;
+	double memory_ratio = 0.2;
+	bool sub_registers = false;
+	uint64_t seed = 0;
+};
+
+// Spacing between block entry points, only the ordering of the vips matters
+constexpr vip_t gen_block_stride = 0x100;
+constexpr vip_t gen_image_base = 0x140000000;
+
+// Registers the generated code computes on, physical registers stay live past the exit so the
+// optimizer cannot throw the whole routine away
+static const x86_reg gen_physical_registers[] = {
+	X86_REG_RAX, X86_REG_RBX, X86_REG_RCX, X86_REG_RDX, X86_REG_RSI, X86_REG_RDI, X86_REG_R8, X86_REG_R9,
+};
+
+// Operand widths of the sub-register shape, one bit operands are flags and single bits of temporaries
+static const bitcnt_t gen_widths[] = { 1, 8, 16, 32, 64 };
+
+// Flag bits the sub-register shape reads and writes: CF, PF, ZF, SF and OF
+static const bitcnt_t gen_flag_bits[] = { 0, 2, 6, 7, 11 };
+
+class routine_generator
+{
+	const gen_config& config;
+	std::mt19937_64 rng;
+
+	// Registers by width, every operand of an instruction has the width picked for it
+	std::map<bitcnt_t, std::vector<register_desc>> registers;
+	bitcnt_t width = 64;
+
+	// Opcodes compile_routine cannot handle are never emitted
+	std::vector<const instruction_desc*> alu_ops;
+	std::vector<const instruction_desc*> compare_ops;
+
+	bool chance(double p)
+	{
+		return std::uniform_real_distribution<double>(0, 1)(rng) < p;
+	}
+
+	size_t pick(size_t count)
+	{
+		return std::uniform_int_distribution<size_t>(0, count - 1)(rng);
+	}
+
+	const register_desc& any_register()
+	{
+		auto& pool = registers[width];
+		return pool[pick(pool.size())];
+	}
+
+	operand register_or_imm()
+	{
+		if (chance(0.5))
+			return any_register();
+
+		int64_t value = std::uniform_int_distribution<int64_t>(-0x1000, 0x1000)(rng);
+		if (width < 64)
+			value &= (1ll << width) - 1;
+		return operand(value, width);
+	}
+
+	// Picks the operand width of the next instruction
+	void pick_width()
+	{
+		width = config.sub_registers ? gen_widths[pick(std::size(gen_widths))] : 64;
+	}
+
+	operand stack_offset()
+	{
+		return operand(-8 * int64_t(1 + pick(32)), 64);
+	}
+
+	void emit_memory(basic_block* block)
+	{
+		// Memory is accessed at byte granularity
+		pick_width();
+		width = std::max<bitcnt_t>(width, 8);
+		if (chance(0.5))
+			block->ldd(any_register(), REG_SP, stack_offset());
+		else
+			block->str(REG_SP, stack_offset(), register_or_imm());
+	}
+
+	void emit_compare(basic_block* block, const register_desc& result)
+	{
+		block->emplace_back(*compare_ops[pick(compare_ops.size())], result, any_register(), register_or_imm());
+	}
+
+	void emit_alu(basic_block* block)
+	{
+		auto op = alu_ops[pick(alu_ops.size())];
+		pick_width();
+		auto& dst = any_register();
+
+		if (*op == ins::bnot || *op == ins::neg)
+			block->emplace_back(*op, dst);
+		else if (*op == ins::bshl || *op == ins::bshr)
+			block->emplace_back(*op, dst, operand(int64_t(pick(width)), 8));
+		else if (*op == ins::ifs)
+		{
+			// The sub-register shape also selects on flag bits and bits of wider registers
+			register_desc cond = block->tmp(1);
+			if (config.sub_registers && chance(0.5))
+				cond = registers[1][pick(registers[1].size())];
+			emit_compare(block, cond);
+			block->ifs(dst, cond, any_register());
+		}
+		else if (*op == ins::tg)
+			emit_compare(block, block->tmp(1));
+		else
+			block->emplace_back(*op, dst, register_or_imm());
+	}
+
+	void emit_body(basic_block* block, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (chance(config.memory_ratio))
+				emit_memory(block);
+			else
+				emit_alu(block);
+		}
+	}
+
+	// Picks a block after the given one, so the control flow graph stays acyclic and always exits
+	size_t later_block(size_t index)
+	{
+		return index + 1 + pick(config.blocks - index - 1);
+	}
+
+	static vip_t block_vip(size_t index)
+	{
+		return gen_image_base + index * gen_block_stride;
+	}
+
+public:
+	routine_generator(const gen_config& config, uint64_t seed)
+		: config(config)
+		, rng(seed)
+	{
+		for (auto op : { &ins::mov, &ins::add, &ins::sub, &ins::band, &ins::bor, &ins::bxor,
+				 &ins::bshl, &ins::bshr, &ins::bnot, &ins::neg, &ins::ifs })
+		{
+			if (can_compile(*op))
+				alu_ops.push_back(op);
+		}
+		for (auto op : { &ins::tg, &ins::tge, &ins::te, &ins::tne, &ins::tle, &ins::tl,
+				 &ins::tug, &ins::tuge, &ins::tule, &ins::tul })
+		{
+			if (can_compile(*op))
+				compare_ops.push_back(op);
+		}
+
+		// Standalone comparisons are emitted through the tg slot
+		//
+		if (!compare_ops.empty())
+			alu_ops.push_back(&ins::tg);
+
+		for (auto op : { &ins::ldd, &ins::str, &ins::js, &ins::jmp, &ins::vexit })
+		{
+			if (!can_compile(*op))
+				fatal("The compiler does not support '%s', which the generator depends on", op->name);
+		}
+		if (compare_ops.empty())
+			fatal("The compiler does not support any comparison, which the generator depends on");
+	}
+
+	routine* generate()
+	{
+		size_t block_count = std::max<size_t>(config.blocks, 1);
+		std::vector<basic_block*> blocks(block_count);
+
+		blocks[0] = basic_block::begin(block_vip(0));
+		routine* rtn = blocks[0]->owner;
+
+		// Temporaries are used by every block, so they are routine wide virtual registers rather than tmp()
+		// registers, which are local to the block allocating them
+		//
+		registers.clear();
+		std::vector<register_desc> temporaries;
+		for (auto id : gen_physical_registers)
+			registers[64].emplace_back(register_physical, uint64_t(id), 64);
+		for (uint64_t id = 0; id < 8; id++)
+			temporaries.emplace_back(register_virtual, id, 64);
+		registers[64].insert(registers[64].end(), temporaries.begin(), temporaries.end());
+
+		// Temporaries start out defined so every use has a reaching definition
+		//
+		for (auto& temporary : temporaries)
+			blocks[0]->mov(temporary, operand(int64_t(rng()), 64));
+
+		// Narrower views of the same registers, both at bit zero and at an offset, and single flag bits. The
+		// flags are defined up front as well, so reading a bit before writing it is still deterministic.
+		//
+		if (config.sub_registers)
+		{
+			for (auto& reg : registers[64])
+			{
+				registers[32].push_back(reg.select(32, 0));
+				registers[16].push_back(reg.select(16, 0));
+				registers[8].push_back(reg.select(8, 0));
+			}
+			for (auto id : { X86_REG_RAX, X86_REG_RBX, X86_REG_RCX, X86_REG_RDX })
+				registers[8].push_back(register_desc(register_physical, uint64_t(id), 8, 8));
+			for (auto& temporary : temporaries)
+			{
+				registers[32].push_back(temporary.select(32, 32));
+				registers[16].push_back(temporary.select(16, 16));
+				registers[8].push_back(temporary.select(8, 24));
+				registers[1].push_back(temporary.select(1, 3));
+			}
+			for (auto bit : gen_flag_bits)
+				registers[1].push_back(REG_FLAGS.select(1, bit));
+
+			blocks[0]->mov(REG_FLAGS, operand(int64_t(rng()), 64));
+		}
+
+		for (size_t index = 0; index < block_count; index++)
+		{
+			auto block = blocks[index];
+			if (!block)
+				block = blocks[index] = rtn->create_block(block_vip(index), nullptr).first;
+
+			auto link = [&](size_t target) {
+				auto [successor, created] = rtn->create_block(block_vip(target), block);
+				blocks[target] = successor;
+			};
+
+			// The body leaves room for the branch sequence
+			//
+			size_t body = config.instructions > 3 ? config.instructions - 3 : 0;
+			emit_body(block, body);
+
+			if (index + 1 == block_count)
+			{
+				block->vexit(0ull);
+			}
+			else if (index + 2 < block_count && config.indirect_fan_out > 1 && chance(config.indirect_density))
+			{
+				// Register indirect jump to a set of distinct later blocks, including the next one so every
+				// block stays reachable
+				//
+				std::vector<size_t> targets = { index + 1 };
+				size_t fan_out = std::min(config.indirect_fan_out, block_count - index - 1);
+				while (config.dense_indirect && targets.size() < fan_out)
+					targets.push_back(index + 1 + targets.size());
+				while (targets.size() < fan_out)
+				{
+					size_t target = later_block(index);
+					if (std::find(targets.begin(), targets.end(), target) == targets.end())
+						targets.push_back(target);
+				}
+
+				width = 64;
+				auto destination = block->tmp(64);
+				block->mov(destination, operand(block_vip(targets[pick(targets.size())]), 64));
+				block->jmp(destination);
+				for (auto target : targets)
+					link(target);
+			}
+			else if (index + 2 < block_count && chance(config.branch_density))
+			{
+				size_t taken = later_block(index);
+				size_t not_taken = index + 1;
+				if (taken == not_taken)
+					taken = later_block(index + 1);
+
+				auto cond = block->tmp(1);
+				pick_width();
+				emit_compare(block, cond);
+				block->js(cond, block_vip(taken), block_vip(not_taken));
+				link(taken);
+				link(not_taken);
+			}
+			else
+			{
+				block->jmp(block_vip(index + 1));
+				link(index + 1);
+			}
+		}
+		return rtn;
+	}
+};
+
+static args::Command gen(commands(), "gen", "Generate synthetic .vtil routines", [](args::Subparser& parser) {
+	// Argument handling
+	args::Positional<std::string> output(parser, "output", "Output .vtil file, or output directory with --count", args::Options::Required);
+	args::ValueFlag<size_t> count(parser, "count", "Number of routines to generate, each with the next seed", { "count" }, 1);
+	args::ValueFlag<size_t> blocks(parser, "blocks", "Number of basic blocks", { "blocks" }, 16);
+	args::ValueFlag<size_t> instructions(parser, "instructions", "Instructions per block", { "instructions" }, 32);
+	args::ValueFlag<double> branchDensity(parser, "ratio", "Share of blocks ending in a conditional branch", { "branch-density" }, 0.3);
+	args::ValueFlag<double> indirectDensity(parser, "ratio", "Share of blocks ending in a register indirect jump", { "indirect-density" }, 0.05);
+	args::ValueFlag<size_t> indirectFanOut(parser, "targets", "Number of targets of each indirect jump", { "indirect-fan-out" }, 4);
+	args::Flag denseIndirect(parser, "dense-indirect", "Indirect jumps target consecutive blocks, like the handler table of a dispatcher", { "dense-indirect" });
+	args::ValueFlag<double> memoryRatio(parser, "ratio", "Share of instructions that load or store", { "memory-ratio" }, 0.2);
+	args::Flag subRegisters(parser, "sub-registers", "Also operate on 8, 16 and 32-bit views, views at a bit offset and single flag bits", { "sub-registers" });
+	args::ValueFlag<uint64_t> seed(parser, "seed", "Random seed", { "seed" }, 0);
+	parser.Parse();
+
+	gen_config config;
+	config.blocks = std::max<size_t>(blocks.Get(), 1);
+	config.instructions = instructions.Get();
+	config.branch_density = branchDensity.Get();
+	config.indirect_density = indirectDensity.Get();
+	config.indirect_fan_out = indirectFanOut.Get();
+	config.dense_indirect = denseIndirect;
+	config.memory_ratio = memoryRatio.Get();
+	config.sub_registers = subRegisters;
+	config.seed = seed.Get();
+
+	// Command implementation
+	if (count.Get() == 1)
+	{
+		std::unique_ptr<routine> rtn{ routine_generator(config, config.seed).generate() };
+		save_routine(rtn.get(), output.Get());
+		log_at(verbosity_level::normal, "[*] Generated %llu blocks, %llu instructions\n", rtn->num_blocks(), rtn->num_instructions());
+		return;
+	}
+
+	fs::create_directories(output.Get());
+	parallel_for(count.Get(), default_jobs(), [&](size_t index) {
+		std::unique_ptr<routine> rtn{ routine_generator(config, config.seed + index).generate() };
+		save_routine(rtn.get(), fs::path(output.Get()) / format::str("gen_%llu.vtil", index));
+	});
+	log_at(verbosity_level::normal, "[*] Generated %llu routines in '%s'\n", count.Get(), output.Get());
+});
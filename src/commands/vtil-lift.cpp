@@ -1,44 +1,180 @@
 #include "vtil-utils.hpp"
-#include "pe_input.hpp"
+#include "lift.hpp"
 
-#include <lifters/core>
-#include <lifters/amd64>
+#include <chrono>
+#include <map>
 
 using namespace vtil;
 using namespace logger;
 
+namespace fs = std::filesystem;
+
+struct lift_result
+{
+	uint64_t address = 0;
+	std::string name;
+	bool success = false;
+	std::string error;
+	size_t blocks = 0;
+	size_t instructions = 0;
+	double milliseconds = 0;
+	const char* exhausted = nullptr;
+	size_t unexplored = 0;
+};
+
 static args::Command lift(commands(), "lift", "Lift a .vtil file", [](args::Subparser& parser) {
 	// Argument handling
 	args::Positional<std::string> input(parser, "input", "Input executable file", args::Options::Required);
-	args::Positional<std::string> output(parser, "output", "Output .vtil file", args::Options::Required);
-	args::HexPositional<uintptr_t> argAddr(parser, "addr", "Virtual address of the function to lift", args::Options::Required);
+	args::Positional<std::string> output(parser, "output", "Output .vtil file, or output directory when lifting several functions", args::Options::Required);
+	args::HexPositionalList<uintptr_t> argAddrs(parser, "addr", "Virtual addresses of the functions to lift");
+	args::ValueFlag<std::string> argList(parser, "file", "File with one hexadecimal function address per line", { "list" });
+	args::Flag argPdata(parser, "pdata", "Lift every function in the exception directory", { "pdata" });
+	args::Flag argExports(parser, "exports", "Lift every exported function", { "exports" });
+	args::ValueFlag<size_t> argJobs(parser, "jobs", "Number of worker threads", { 'j', "jobs" }, default_jobs());
+	args::Flag argNoCache(parser, "no-lift-cache", "Lift every instruction again instead of reusing earlier lifts of the same bytes", { "no-lift-cache" });
+	args::ValueFlag<size_t> argExploreJobs(parser, "jobs", "Number of threads exploring each function", { "explore-jobs" }, 1);
+	args::ValueFlag<size_t> argMaxBlocks(parser, "blocks", "Stop exploring a function after this many blocks", { "max-blocks" });
+	args::ValueFlag<size_t> argMaxInstructions(parser, "instructions", "Stop exploring a function after this many instructions", { "max-instructions" });
+	args::ValueFlag<double> argTimeout(parser, "seconds", "Stop exploring a function after this many seconds", { "timeout" });
 	parser.Parse();
 
+	// Functions cut off by a budget are still written, the edges that were not followed leave the
+	// routine through vexit and are listed in a .unexplored file next to it
+	//
+	explore_options options;
+	options.jobs = argExploreJobs.Get();
+	options.budget.max_blocks = argMaxBlocks ? argMaxBlocks.Get() : 0;
+	options.budget.max_instructions = argMaxInstructions ? argMaxInstructions.Get() : 0;
+	options.budget.timeout = std::chrono::milliseconds(argTimeout ? int64_t(argTimeout.Get() * 1000) : 0);
+
+	auto save_explored = [&](const explored_function& explored, const fs::path& path) {
+		save_routine(explored.rtn, path);
+		fs::path unexplored_path = fs::path(path).replace_extension(".unexplored");
+		if (explored.exhausted)
+			save_unexplored(explored.unexplored, unexplored_path);
+		else
+			fs::remove(unexplored_path);
+	};
+
 	// Command implementation
-	auto addr = argAddr.Get();
-	std::ifstream pe_stream(input.Get(), std::ifstream::binary);
-	pe_stream.unsetf(std::ios::skipws); // ehhh
-	if (!pe_stream.is_open())
-		fatal("Could not open executable '%s'", input.Get());
+	lift_cache::instance().enabled = !argNoCache;
+	loaded_pe pe(input.Get());
+	auto& pe_vtil = *pe.input;
+
+	// Collect the functions to lift, keyed by address to drop duplicates
+	//
+	std::map<uint64_t, std::string> functions;
+	for (auto addr : argAddrs.Get())
+		functions.emplace(addr, "");
+	if (argList)
+	{
+		std::ifstream list(argList.Get());
+		if (!list.is_open())
+			fatal("Could not open address list '%s'", argList.Get());
+		for (std::string line; std::getline(list, line);)
+		{
+			if (line.find_first_not_of(" \t\r") == std::string::npos || line[0] == '#')
+				continue;
+			functions.emplace(std::stoull(line, nullptr, 16), "");
+		}
+	}
+	if (argExports)
+	{
+		for (auto& [addr, name] : enum_exports(pe_vtil))
+			functions[addr] = name;
+	}
+	if (argPdata)
+	{
+		for (auto addr : enum_pdata_functions(pe_vtil))
+			functions.emplace(addr, "");
+	}
+
+	if (functions.empty())
+		fatal("No functions to lift");
 
-	std::istream_iterator<uint8_t> pe_start(pe_stream), pe_end;
-	std::vector<uint8_t> pe_bytes(pe_start, pe_end);
+	for (auto& [addr, name] : functions)
+	{
+		if (!pe.contains(addr))
+			fatal("Address 0x%llx not inside image", addr);
+	}
 
-	pe_image image{ pe_bytes };
-	if (!image.is_valid() || !image.is_pe64())
-		fatal("Image is not a 64-bit PE file");
+	// A single explicit address keeps writing to the output file
+	//
+	bool single = functions.size() == 1 && !argList && !argPdata && !argExports && !fs::is_directory(output.Get());
+	if (single)
+	{
+		auto explored = explore_function(pe_vtil, functions.begin()->first, options);
+		save_explored(explored, output.Get());
+		if (explored.exhausted)
+			log<CON_YLW>("[!] Stopped at %s, %llu edges left unexplored\n", explored.exhausted, explored.unexplored.size());
+		if (!argNoCache)
+			lift_cache::instance().report();
+		return;
+	}
 
-	if (addr < image.get_image_base() || addr >= image.get_image_base() + image.get_image_size())
-		fatal("Address 0x%llx not inside image", addr);
+	fs::path output_dir = output.Get();
+	fs::create_directories(output_dir);
 
-	pe_input pe_vtil{ image };
-	using amd64_recursive_descent = lifter::recursive_descent<pe_input, lifter::amd64::lifter_t>;
-	amd64_recursive_descent rd(&pe_vtil, addr);
+	auto names = function_file_names(functions);
+	std::vector<lift_result> results;
+	for (auto& [addr, name] : functions)
+	{
+		auto& result = results.emplace_back();
+		result.address = addr;
+		result.name = names[results.size() - 1];
+	}
 
-	rd.explore();
-	auto rtn = rd.entry->owner;
-	rtn->routine_convention = amd64::default_call_convention;
-	rtn->routine_convention.purge_stack = true;
+	// Every worker lifts against the same read-only image
+	//
+	auto start = std::chrono::steady_clock::now();
+	parallel_for(results.size(), argJobs.Get(), [&](size_t index) {
+		auto& result = results[index];
+		auto t0 = std::chrono::steady_clock::now();
+		try
+		{
+			auto explored = explore_function(pe_vtil, result.address, options);
+			std::unique_ptr<routine> rtn{ explored.rtn };
+			result.blocks = rtn->num_blocks();
+			result.instructions = rtn->num_instructions();
+			result.exhausted = explored.exhausted;
+			result.unexplored = explored.unexplored.size();
+			save_explored(explored, output_dir / (result.name + ".vtil"));
+			result.success = true;
+		}
+		catch (const std::exception& e)
+		{
+			result.error = e.what();
+		}
+		result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-	save_routine(rtn, output.Get());
+	// Summary
+	//
+	size_t succeeded = 0, partial = 0;
+	log_at(verbosity_level::normal, "\n%-18s %-32s %8s %12s %10s\n", "address", "name", "blocks", "instructions", "time");
+	for (const auto& result : results)
+	{
+		if (result.success)
+		{
+			succeeded++;
+			if (result.exhausted)
+			{
+				partial++;
+				log<CON_YLW>("0x%-16llx %-32s %8llu %12llu %8.2fms stopped at %s, %llu unexplored edges\n", result.address, result.name,
+					result.blocks, result.instructions, result.milliseconds, result.exhausted, result.unexplored);
+				continue;
+			}
+			log_at(verbosity_level::normal, "0x%-16llx %-32s %8llu %12llu %8.2fms\n", result.address, result.name, result.blocks, result.instructions, result.milliseconds);
+		}
+		else
+		{
+			log<CON_RED>("0x%-16llx %-32s failed: %s\n", result.address, result.name, result.error);
+		}
+	}
+	log_at(verbosity_level::normal, "\n[*] Lifted %llu/%llu functions in %.2fs using %llu jobs\n", succeeded, results.size(), seconds, argJobs.Get());
+	if (partial)
+		log<CON_YLW>("[*] %llu functions stopped at a budget and were written partially\n", partial);
+	if (!argNoCache)
+		lift_cache::instance().report();
 });
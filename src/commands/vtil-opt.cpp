@@ -1,20 +1,280 @@
 #include "vtil-utils.hpp"
+#include "opt_pipeline.hpp"
+#include "artifact_cache.hpp"
+#include "vtil_pack.hpp"
 
 #include <vtil/compiler>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <optional>
+
 using namespace vtil;
 using namespace logger;
 
-// TODO: add arguments for calling convention/stack purge/passes
-// TODO: add flag to enable/disable profiling output
+namespace fs = std::filesystem;
+
+struct batch_result
+{
+	fs::path input;
+	bool success = false;
+	std::string error;
+	size_t blocks = 0;
+	size_t instructions_before = 0;
+	size_t instructions_after = 0;
+	double milliseconds = 0;
+	bool budget_exceeded = false;
+	bool cached = false;
+	routine_profile profile;
+};
+
+struct opt_config
+{
+	// Custom pipeline, optimizer::apply_all is used if none is selected
+	std::optional<opt_pipeline> pipeline;
+	opt_budget budget;
+	fs::path profile_json;
+	std::unique_ptr<artifact_cache> cache;
+
+	// Describes everything besides the input that determines the output, budgets are left out since
+	// only runs that completed within them are cached
+	std::string cache_config() const
+	{
+		return "opt:" + (pipeline ? describe_pipeline(*pipeline) : std::string("apply_all"));
+	}
+};
+
+static void write_profile(const fs::path& path, const std::vector<routine_profile>& profiles)
+{
+	std::ofstream out(path);
+	if (!out.is_open())
+		fatal("Failed to open profile file '%s'", path.string());
+	out << profile_report(profiles).dump(true) << '\n';
+}
+
+// Runs the selected pipeline, spelling out the default passes when a profile is requested. Returns false
+// if a budget cut the pipeline short.
+static bool optimize(routine* rtn, const opt_config& config, routine_profile* profile)
+{
+	if (!config.pipeline && !profile)
+	{
+		optimizer::apply_all(rtn);
+		return true;
+	}
+	return run_pipeline(rtn, config.pipeline ? *config.pipeline : default_pipeline(), config.budget, profile);
+}
+
+static void optimize_batch(const std::vector<fs::path>& inputs, const fs::path& root, const fs::path& output, size_t jobs, const opt_config& config)
+{
+	// Schedule the biggest routines first so a single straggler does not hold up the batch
+	//
+	auto relative = batch_relative_paths(inputs, root);
+	std::vector<std::pair<size_t, uintmax_t>> queue;
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		std::error_code ec;
+		auto size = fs::file_size(inputs[i], ec);
+		queue.emplace_back(i, ec ? 0 : size);
+	}
+	std::stable_sort(queue.begin(), queue.end(), [](const auto& a, const auto& b) {
+		return a.second > b.second;
+	});
+
+	std::vector<batch_result> results(queue.size());
+	std::atomic<size_t> done = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	parallel_for(queue.size(), jobs, [&](size_t index) {
+		auto& result = results[index];
+		result.input = inputs[queue[index].first];
+
+		auto t0 = std::chrono::steady_clock::now();
+		try
+		{
+			auto destination = output / relative[queue[index].first];
+			fs::create_directories(destination.parent_path());
+
+			std::string key;
+			if (config.cache)
+			{
+				key = artifact_cache::make_key(read_file_bytes(result.input), config.cache_config());
+				if (auto hit = config.cache->get(key))
+				{
+					write_file_bytes(destination, *hit);
+					result.cached = true;
+				}
+			}
+
+			if (!result.cached)
+			{
+				std::unique_ptr<routine> rtn{ load_routine(result.input) };
+				result.instructions_before = rtn->num_instructions();
+				result.profile.routine = result.input.string();
+				result.budget_exceeded = !optimize(rtn.get(), config, config.profile_json.empty() ? nullptr : &result.profile);
+				result.instructions_after = rtn->num_instructions();
+				result.blocks = rtn->num_blocks();
+				save_routine(rtn.get(), destination);
+
+				if (config.cache && !result.budget_exceeded)
+					config.cache->put(key, read_file_bytes(destination));
+			}
+			result.success = true;
+		}
+		catch (const std::exception& e)
+		{
+			result.error = e.what();
+		}
+		result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		auto n = ++done;
+		if (result.cached)
+		{
+			log_at(verbosity_level::normal, "[%llu/%llu] %s: cached (%.2fms)\n", n, queue.size(), result.input.string(), result.milliseconds);
+		}
+		else if (result.success)
+		{
+			if (is_verbose(verbosity_level::normal))
+				log<CON_GRN>("[%llu/%llu] %s: %llu -> %llu instructions, %llu blocks (%.2fms)%s\n",
+					n, queue.size(), result.input.string(), result.instructions_before, result.instructions_after, result.blocks, result.milliseconds,
+					result.budget_exceeded ? ", budget exceeded" : "");
+		}
+		else
+		{
+			log<CON_RED>("[%llu/%llu] %s: %s\n", n, queue.size(), result.input.string(), result.error);
+		}
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t succeeded = 0, instructions = 0, truncated = 0;
+	for (const auto& result : results)
+	{
+		if (!result.success)
+			continue;
+		succeeded++;
+		truncated += result.budget_exceeded;
+		instructions += result.instructions_before;
+	}
+
+	log_at(verbosity_level::normal, "\n[*] Optimized %llu/%llu routines in %.2fs using %llu jobs\n", succeeded, results.size(), seconds, jobs);
+	log_at(verbosity_level::normal, "[*] Throughput: %.2f routines/s, %.2f instructions/s\n",
+		seconds > 0 ? succeeded / seconds : 0.0, seconds > 0 ? instructions / seconds : 0.0);
+	if (config.cache)
+		config.cache->report();
+	if (truncated)
+		log<CON_YLW>("[*] %llu routines were cut short by the time budget\n", truncated);
+	if (succeeded != results.size())
+		log<CON_RED>("[*] %llu routines failed to optimize\n", results.size() - succeeded);
+
+	// A single report covering every routine that was optimized
+	//
+	if (!config.profile_json.empty())
+	{
+		std::vector<routine_profile> profiles;
+		for (auto& result : results)
+		{
+			if (result.success && !result.cached)
+				profiles.push_back(std::move(result.profile));
+		}
+		write_profile(config.profile_json, profiles);
+	}
+}
+
+// TODO: add arguments for calling convention/stack purge
 static args::Command opt(commands(), "opt", "Optimize a .vtil file", [](args::Subparser& parser) {
 	// Argument handling
-	args::Positional<std::string> input(parser, "input", "Input .vtil file", args::Options::Required);
-	args::Positional<std::string> output(parser, "output", "Output .vtil file", args::Options::Required);
+	args::Positional<std::string> input(parser, "input", "Input .vtil file, pack.vtilpack:name or directory", args::Options::Required);
+	args::Positional<std::string> output(parser, "output", "Output .vtil file or directory", args::Options::Required);
+	args::Flag list(parser, "list", "Treat the input as a list file with one .vtil path per line", { 'l', "list" });
+	args::ValueFlag<size_t> jobs(parser, "jobs", "Number of worker threads in batch mode", { 'j', "jobs" }, default_jobs());
+	args::ValueFlag<std::string> profileJson(parser, "file", "Write per pass and per routine optimizer statistics as JSON", { "profile-json" });
+	args::ValueFlag<int> level(parser, "level", "Optimization preset: 0 (none), 1 (cheap local passes) or 2 (default pipeline)", { 'O' });
+	args::ValueFlag<std::string> passes(parser, "passes", "Comma separated pass list, passes inside [] repeat until nothing changes", { "passes" });
+	args::ValueFlag<double> routineBudget(parser, "ms", "Wall-clock budget per routine, the result so far is kept once it runs out", { "routine-budget" });
+	args::ValueFlag<double> passBudget(parser, "ms", "Wall-clock budget per pass, passes that overrun it are dropped for the routine", { "pass-budget" });
+	args::ValueFlag<std::string> cacheDir(parser, "dir", "Reuse optimized routines from a content addressed cache directory", { "cache" });
+	args::ValueFlag<uint64_t> cacheSize(parser, "MB", "Maximum size of the cache directory", { "cache-size" }, 1024);
 	parser.Parse();
 
+	if (level && passes)
+		fatal("-O and --passes are mutually exclusive");
+
+	opt_config config;
+	if (level)
+		config.pipeline = preset_pipeline(level.Get());
+	else if (passes)
+		config.pipeline = parse_pipeline(passes.Get());
+	if (routineBudget)
+		config.budget.routine_milliseconds = routineBudget.Get();
+	if (passBudget)
+		config.budget.pass_milliseconds = passBudget.Get();
+	if (profileJson)
+		config.profile_json = profileJson.Get();
+	if (cacheDir)
+		config.cache = std::make_unique<artifact_cache>(cacheDir.Get(), cacheSize.Get() * 1024 * 1024);
+
+	// Budgets need the passes spelled out
+	//
+	if (!config.pipeline && (routineBudget || passBudget))
+		config.pipeline = default_pipeline();
+
 	// Command implementation
-	auto rtn = load_routine(input.Get());
-	optimizer::apply_all_profiled(rtn);
-	save_routine(rtn, output.Get());
+	if (!list && !fs::is_directory(input.Get()))
+	{
+		auto ref = parse_routine_ref(input.Get());
+		std::string key;
+		if (config.cache)
+		{
+			key = artifact_cache::make_key(read_routine_bytes(ref), config.cache_config());
+			if (auto hit = config.cache->get(key))
+			{
+				write_file_bytes(output.Get(), *hit);
+				config.cache->report();
+				return;
+			}
+		}
+
+		auto rtn = load_routine_ref(ref);
+		bool completed = true;
+		if (!config.profile_json.empty())
+		{
+			routine_profile profile;
+			profile.routine = input.Get();
+			completed = optimize(rtn, config, &profile);
+			write_profile(config.profile_json, { profile });
+		}
+		else if (config.pipeline)
+		{
+			completed = optimize(rtn, config, nullptr);
+		}
+		else if (is_verbose(verbosity_level::normal))
+		{
+			optimizer::apply_all_profiled(rtn);
+		}
+		else
+		{
+			optimizer::apply_all(rtn);
+		}
+		save_routine(rtn, output.Get());
+
+		if (!completed)
+			log<CON_YLW>("Optimization was cut short by the time budget\n");
+		if (config.cache)
+		{
+			if (completed)
+				config.cache->put(key, read_file_bytes(output.Get()));
+			config.cache->report();
+		}
+		return;
+	}
+
+	// Batch mode, the input tree layout is mirrored in the output directory
+	//
+	fs::path root = list ? fs::path(input.Get()).parent_path() : fs::path(input.Get());
+	auto inputs = list ? read_list_file(input.Get()) : enum_vtil_files(input.Get());
+	if (inputs.empty())
+		fatal("No .vtil files found in '%s'", input.Get());
+
+	optimize_batch(inputs, root, output.Get(), jobs.Get(), config);
 });
@@ -0,0 +1,109 @@
+#include "vtil-utils.hpp"
+#include "vtil_pack.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace vtil;
+using namespace logger;
+
+namespace fs = std::filesystem;
+
+static args::Command pack(commands(), "pack", "Pack .vtil files into an indexed .vtilpack file", [](args::Subparser& parser) {
+	// Argument handling
+	args::Positional<std::string> output(parser, "output", "Output .vtilpack file", args::Options::Required);
+	args::PositionalList<std::string> inputs(parser, "inputs", "Input .vtil files or directories", args::Options::Required);
+	args::ValueFlag<size_t> jobs(parser, "jobs", "Number of worker threads", { 'j', "jobs" }, default_jobs());
+	parser.Parse();
+
+	// Routines are named after their path relative to the directory they were found in, inputs from
+	// different directories may share a name and are disambiguated
+	//
+	std::vector<fs::path> sources, names;
+	for (const auto& input : inputs.Get())
+	{
+		fs::path root = fs::is_directory(input) ? fs::path(input) : fs::path(input).parent_path();
+		for (const auto& file : enum_vtil_files(input))
+		{
+			sources.push_back(file);
+			names.push_back(batch_relative_path(file, root).replace_extension());
+		}
+	}
+	if (sources.empty())
+		fatal("No .vtil files to pack");
+	disambiguate_paths(names);
+
+	std::vector<std::pair<fs::path, std::string>> files;
+	for (size_t i = 0; i < sources.size(); i++)
+		files.emplace_back(sources[i], names[i].generic_string());
+
+	std::vector<pack_source> routines(files.size());
+	auto start = std::chrono::steady_clock::now();
+	parallel_for(files.size(), jobs.Get(), [&](size_t index) {
+		auto& source = routines[index];
+		source.name = files[index].second;
+		source.data = read_file_bytes(files[index].first);
+
+		// Deserializing validates the routine and provides the counts stored in the index
+		//
+		std::unique_ptr<routine> rtn{ deserialize_routine(source.data.data(), source.data.size()) };
+		source.blocks = uint32_t(rtn->num_blocks());
+		source.instructions = uint32_t(rtn->num_instructions());
+	});
+
+	std::sort(routines.begin(), routines.end(), [](const pack_source& a, const pack_source& b) {
+		return a.name < b.name;
+	});
+	for (size_t i = 1; i < routines.size(); i++)
+	{
+		if (routines[i].name == routines[i - 1].name)
+			fatal("Duplicate routine name '%s'", routines[i].name);
+	}
+
+	write_pack(output.Get(), routines);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	log_at(verbosity_level::normal, "[*] Packed %llu routines into '%s' in %.2fs\n", routines.size(), output.Get(), seconds);
+});
+
+static args::Command unpack(commands(), "unpack", "Unpack a .vtilpack file into .vtil files", [](args::Subparser& parser) {
+	// Argument handling
+	args::Positional<std::string> input(parser, "input", "Input .vtilpack file", args::Options::Required);
+	args::Positional<std::string> output(parser, "output", "Output directory", args::Options::Required);
+	args::PositionalList<std::string> names(parser, "names", "Routines to unpack, defaults to all of them");
+	parser.Parse();
+
+	// Command implementation
+	vtil_pack pack(input.Get());
+
+	std::vector<const pack_entry*> entries;
+	if (names)
+	{
+		for (const auto& name : names.Get())
+		{
+			auto entry = pack.find(name);
+			if (!entry)
+				fatal("No routine named '%s' in '%s'", name, input.Get());
+			entries.push_back(entry);
+		}
+	}
+	else
+	{
+		for (const auto& entry : pack.entries())
+			entries.push_back(&entry);
+	}
+
+	for (auto entry : entries)
+	{
+		// Names come from the pack, do not let them escape the output directory
+		//
+		fs::path relative = fs::path(entry->name).lexically_normal();
+		if (relative.is_absolute() || relative.empty() || *relative.begin() == "..")
+			fatal("Refusing to unpack routine with unsafe name '%s'", entry->name);
+
+		auto destination = fs::path(output.Get()) / relative;
+		destination += ".vtil";
+		fs::create_directories(destination.parent_path());
+		write_file_bytes(destination, { pack.data(*entry), pack.data(*entry) + entry->size });
+	}
+	log_at(verbosity_level::normal, "[*] Unpacked %llu routines into '%s'\n", entries.size(), output.Get());
+});
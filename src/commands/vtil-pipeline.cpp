@@ -0,0 +1,305 @@
+#include "vtil-utils.hpp"
+#include "lift.hpp"
+#include "jit.hpp"
+#include "opt_pipeline.hpp"
+#include "bounded_queue.hpp"
+
+#include <vtil/compiler>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <optional>
+#include <thread>
+
+using namespace vtil;
+using namespace logger;
+
+namespace fs = std::filesystem;
+
+struct pipeline_result
+{
+	uint64_t address = 0;
+	std::string name;
+	bool success = false;
+	std::string error;
+	size_t instructions_lifted = 0;
+	size_t instructions_optimized = 0;
+	size_t code_size = 0;
+	const char* exhausted = nullptr;
+};
+
+// Routine handed from one stage to the next, index refers to the result slot of the function
+struct pipeline_item
+{
+	size_t index;
+	std::unique_ptr<routine> rtn;
+};
+
+// Worker pool of one stage, busy time is the time spent on items excluding queue waits
+struct pipeline_stage
+{
+	const char* name;
+	size_t workers;
+	std::atomic<size_t> items = 0;
+	std::atomic<uint64_t> busy_microseconds = 0;
+	std::vector<std::thread> threads;
+
+	pipeline_stage(const char* name, size_t workers)
+		: name(name)
+		, workers(std::max<size_t>(workers, 1))
+	{
+	}
+
+	template<typename F>
+	void start(F&& fn)
+	{
+		for (size_t i = 0; i < workers; i++)
+			threads.emplace_back(fn);
+	}
+
+	void join()
+	{
+		for (auto& thread : threads)
+			thread.join();
+		threads.clear();
+	}
+
+	// Measures fn and adds it to the busy time of the stage
+	template<typename F>
+	void measure(F&& fn)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		fn();
+		busy_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+		items++;
+	}
+};
+
+static void print_stage(const pipeline_stage& stage, double seconds)
+{
+	double busy = stage.busy_microseconds / 1e6;
+	log_at(verbosity_level::normal, "%-8s %8llu %8llu %10.2fs %11.1f%%\n", stage.name, stage.workers, stage.items.load(), busy,
+		seconds > 0 ? 100.0 * busy / (seconds * stage.workers) : 0.0);
+}
+
+template<typename T>
+static void print_queue(const char* name, bounded_queue<T>& queue)
+{
+	auto stats = queue.get_statistics();
+	log_at(verbosity_level::normal, "%-18s %8llu %10.1f %10llu %12.2fs %12.2fs\n", name, stats.pushes, stats.mean_depth(), stats.max_depth,
+		stats.push_wait_milliseconds / 1000, stats.pop_wait_milliseconds / 1000);
+}
+
+static args::Command pipeline(commands(), "pipeline", "Lift, optimize and compile functions in a single process", [](args::Subparser& parser) {
+	// Argument handling
+	args::Positional<std::string> input(parser, "input", "Input executable file", args::Options::Required);
+	args::Positional<std::string> output(parser, "output", "Output directory for the compiled .bin files", args::Options::Required);
+	args::HexPositionalList<uintptr_t> argAddrs(parser, "addr", "Virtual addresses of the functions to lift");
+	args::Flag argPdata(parser, "pdata", "Lift every function in the exception directory", { "pdata" });
+	args::Flag argExports(parser, "exports", "Lift every exported function", { "exports" });
+	args::ValueFlag<size_t> liftJobs(parser, "jobs", "Number of lift workers", { "lift-jobs" }, std::max<size_t>(default_jobs() / 4, 1));
+	args::ValueFlag<size_t> optJobs(parser, "jobs", "Number of optimizer workers", { "opt-jobs" }, std::max<size_t>(default_jobs() / 2, 1));
+	args::ValueFlag<size_t> compileJobs(parser, "jobs", "Number of compiler workers", { "compile-jobs" }, std::max<size_t>(default_jobs() / 4, 1));
+	args::ValueFlag<size_t> queueSize(parser, "routines", "Capacity of the queues between stages", { "queue-size" }, 16);
+	args::ValueFlag<int> level(parser, "level", "Optimization preset: 0 (none), 1 (cheap local passes) or 2 (default pipeline)", { 'O' });
+	args::ValueFlag<std::string> passes(parser, "passes", "Comma separated pass list, passes inside [] repeat until nothing changes", { "passes" });
+	args::Flag saveLifted(parser, "save-lifted", "Also write the lifted routines to <output>/lifted", { "save-lifted" });
+	args::Flag saveOptimized(parser, "save-optimized", "Also write the optimized routines to <output>/optimized", { "save-optimized" });
+	args::ValueFlag<size_t> maxBlocks(parser, "blocks", "Stop exploring a function after this many blocks", { "max-blocks" });
+	args::ValueFlag<size_t> maxInstructions(parser, "instructions", "Stop exploring a function after this many instructions", { "max-instructions" });
+	args::ValueFlag<double> timeout(parser, "seconds", "Stop exploring a function after this many seconds", { "timeout" });
+	parser.Parse();
+
+	// Functions cut off by a budget continue through the pipeline, see explore_function
+	//
+	explore_options explore;
+	explore.budget.max_blocks = maxBlocks ? maxBlocks.Get() : 0;
+	explore.budget.max_instructions = maxInstructions ? maxInstructions.Get() : 0;
+	explore.budget.timeout = std::chrono::milliseconds(timeout ? int64_t(timeout.Get() * 1000) : 0);
+
+	if (level && passes)
+		fatal("-O and --passes are mutually exclusive");
+
+	std::optional<opt_pipeline> passes_to_run;
+	if (level)
+		passes_to_run = preset_pipeline(level.Get());
+	else if (passes)
+		passes_to_run = parse_pipeline(passes.Get());
+
+	// Command implementation
+	loaded_pe pe(input.Get());
+	auto& pe_vtil = *pe.input;
+
+	// Collect the functions to lift, keyed by address to drop duplicates
+	//
+	std::map<uint64_t, std::string> functions;
+	for (auto addr : argAddrs.Get())
+		functions.emplace(addr, "");
+	if (argExports)
+	{
+		for (auto& [addr, name] : enum_exports(pe_vtil))
+			functions[addr] = name;
+	}
+	if (argPdata)
+	{
+		for (auto addr : enum_pdata_functions(pe_vtil))
+			functions.emplace(addr, "");
+	}
+	if (functions.empty())
+		fatal("No functions to lift");
+
+	auto names = function_file_names(functions);
+	std::vector<pipeline_result> results;
+	for (auto& [addr, name] : functions)
+	{
+		if (!pe.contains(addr))
+			fatal("Address 0x%llx not inside image", addr);
+
+		auto& result = results.emplace_back();
+		result.address = addr;
+		result.name = names[results.size() - 1];
+	}
+
+	fs::path output_dir = output.Get();
+	fs::create_directories(output_dir);
+	if (saveLifted)
+		fs::create_directories(output_dir / "lifted");
+	if (saveOptimized)
+		fs::create_directories(output_dir / "optimized");
+
+	// Every result slot is only written by the worker currently holding its routine, failures end the
+	// routine's trip through the pipeline
+	//
+	auto fail = [&](size_t index, const std::exception& e) {
+		results[index].error = e.what();
+		log<CON_RED>("0x%llx %s failed: %s\n", results[index].address, results[index].name, e.what());
+	};
+
+	bounded_queue<pipeline_item> lifted(queueSize.Get());
+	bounded_queue<pipeline_item> optimized(queueSize.Get());
+	pipeline_stage lift_stage("lift", liftJobs.Get());
+	pipeline_stage opt_stage("opt", optJobs.Get());
+	pipeline_stage compile_stage("compile", compileJobs.Get());
+
+	asmjit::JitRuntime rt;
+	asmjit::Environment environment = rt.environment();
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::atomic<size_t> next = 0;
+	lift_stage.start([&]() {
+		for (size_t index; (index = next++) < results.size();)
+		{
+			std::unique_ptr<routine> rtn;
+			lift_stage.measure([&]() {
+				try
+				{
+					auto explored = explore_function(pe_vtil, results[index].address, explore);
+					rtn.reset(explored.rtn);
+					results[index].instructions_lifted = rtn->num_instructions();
+					results[index].exhausted = explored.exhausted;
+					if (explored.exhausted)
+						save_unexplored(explored.unexplored, output_dir / (results[index].name + ".unexplored"));
+					if (saveLifted)
+						save_routine(rtn.get(), output_dir / "lifted" / (results[index].name + ".vtil"));
+				}
+				catch (const std::exception& e)
+				{
+					rtn.reset();
+					fail(index, e);
+				}
+			});
+			if (rtn)
+				lifted.push({ index, std::move(rtn) });
+		}
+	});
+
+	opt_stage.start([&]() {
+		while (auto item = lifted.pop())
+		{
+			bool success = false;
+			opt_stage.measure([&]() {
+				try
+				{
+					if (passes_to_run)
+						run_pipeline(item->rtn.get(), *passes_to_run);
+					else
+						optimizer::apply_all(item->rtn.get());
+					results[item->index].instructions_optimized = item->rtn->num_instructions();
+					if (saveOptimized)
+						save_routine(item->rtn.get(), output_dir / "optimized" / (results[item->index].name + ".vtil"));
+					success = true;
+				}
+				catch (const std::exception& e)
+				{
+					fail(item->index, e);
+				}
+			});
+			if (success)
+				optimized.push(std::move(*item));
+		}
+	});
+
+	compile_stage.start([&]() {
+		jit_context context(environment);
+		while (auto item = optimized.pop())
+		{
+			compile_stage.measure([&]() {
+				auto& result = results[item->index];
+				try
+				{
+					auto code = context.compile(item->rtn.get());
+					write_file_bytes(output_dir / (result.name + ".bin"), code);
+					result.code_size = code.size();
+					result.success = true;
+				}
+				catch (const std::exception& e)
+				{
+					fail(item->index, e);
+				}
+				item->rtn.reset();
+			});
+		}
+	});
+
+	// Each queue is closed once every producer feeding it is done
+	//
+	lift_stage.join();
+	lifted.close();
+	opt_stage.join();
+	optimized.close();
+	compile_stage.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Summary
+	//
+	size_t succeeded = 0, partial = 0;
+	if (is_verbose(verbosity_level::verbose))
+		log("\n%-18s %-32s %12s %12s %10s\n", "address", "name", "lifted", "optimized", "code size");
+	for (const auto& result : results)
+	{
+		if (!result.success)
+			continue;
+		succeeded++;
+		if (result.exhausted)
+			partial++;
+		if (is_verbose(verbosity_level::verbose))
+			log("0x%-16llx %-32s %12llu %12llu %10llu\n", result.address, result.name, result.instructions_lifted, result.instructions_optimized, result.code_size);
+	}
+
+	log_at(verbosity_level::normal, "\n%-8s %8s %8s %11s %12s\n", "stage", "workers", "routines", "busy", "utilization");
+	print_stage(lift_stage, seconds);
+	print_stage(opt_stage, seconds);
+	print_stage(compile_stage, seconds);
+
+	log_at(verbosity_level::normal, "\n%-18s %8s %10s %10s %13s %13s\n", "queue", "routines", "mean depth", "max depth", "producer wait", "consumer wait");
+	print_queue("lift -> opt", lifted);
+	print_queue("opt -> compile", optimized);
+
+	log_at(verbosity_level::normal, "\n[*] Compiled %llu/%llu functions in %.2fs\n", succeeded, results.size(), seconds);
+	if (partial)
+		log<CON_YLW>("[*] %llu functions stopped at a budget and were compiled partially\n", partial);
+	lift_cache::instance().report();
+});
@@ -0,0 +1,529 @@
+#include "vtil-utils.hpp"
+#include "jit.hpp"
+#include "json.hpp"
+
+#include <vtil/vtil>
+#include <vtil/compiler>
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <utility>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace asmjit;
+using namespace vtil::logger;
+
+namespace fs = std::filesystem;
+
+// Registers in x86 encoding order, the index is the AsmJit register id
+//
+static const char* const gpr_names[16] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+static const x86_reg gpr_capstone_ids[16] = {
+	X86_REG_RAX, X86_REG_RCX, X86_REG_RDX, X86_REG_RBX, X86_REG_RSP, X86_REG_RBP, X86_REG_RSI, X86_REG_RDI,
+	X86_REG_R8, X86_REG_R9, X86_REG_R10, X86_REG_R11, X86_REG_R12, X86_REG_R13, X86_REG_R14, X86_REG_R15
+};
+static constexpr uint32_t rsp_id = 4;
+
+// Size of the private stack the compiled code runs on
+//
+static constexpr size_t sandbox_stack_size = 1 << 20;
+
+// Initial machine state, stack values are placed right above the return address
+//
+struct exec_seed
+{
+	uint64_t gpr[16] = {};
+	std::vector<uint64_t> stack;
+};
+
+// Register file exchanged with the trampoline
+//
+struct exec_context
+{
+	uint64_t gpr[16];
+	uint64_t host_rsp;
+};
+
+struct exec_sandbox
+{
+	exec_context context = {};
+	std::vector<uint64_t> stack = std::vector<uint64_t>(sandbox_stack_size / 8);
+
+	// Entry stack pointer before the call pushes its return address, 16-byte aligned with
+	// room for the seeded stack values above it
+	//
+	uint64_t entry_rsp(const exec_seed& seed) const
+	{
+		uint64_t top = uint64_t(stack.data() + stack.size()) & ~uint64_t(15);
+		return (top - (seed.stack.size() + 8) * 8) & ~uint64_t(15);
+	}
+
+	void reset(const exec_seed& seed)
+	{
+		memcpy(context.gpr, seed.gpr, sizeof(context.gpr));
+		context.gpr[rsp_id] = entry_rsp(seed);
+		if (!seed.stack.empty())
+			memcpy((void*)context.gpr[rsp_id], seed.stack.data(), seed.stack.size() * 8);
+	}
+};
+
+static int gpr_index(const std::string& name)
+{
+	for (int i = 0; i < 16; i++)
+	{
+		if (name == gpr_names[i])
+			return i;
+	}
+	return -1;
+}
+
+static exec_seed parse_seed(const std::string& seed_file, const std::vector<std::string>& assignments)
+{
+	exec_seed seed;
+	if (!seed_file.empty())
+	{
+		std::ifstream stream(seed_file);
+		if (!stream.is_open())
+			fatal("Could not open seed file '%s'", seed_file);
+		std::string text{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+		// Registers may be given at the top level or in a "registers" object
+		//
+		auto document = json::parse(text);
+		auto registers = document.find("registers") ? *document.find("registers") : document;
+		for (auto& [name, value] : registers.members)
+		{
+			if (name == "stack" || name == "registers")
+				continue;
+			int index = gpr_index(name);
+			if (index < 0)
+				fatal("Unknown register '%s' in seed", name);
+			seed.gpr[index] = value.as_u64();
+		}
+		if (auto stack = document.find("stack"))
+		{
+			for (auto& value : stack->items)
+				seed.stack.push_back(value.as_u64());
+		}
+	}
+
+	for (const auto& assignment : assignments)
+	{
+		auto separator = assignment.find('=');
+		int index = gpr_index(assignment.substr(0, separator));
+		if (separator == std::string::npos || index < 0)
+			fatal("Invalid register assignment '%s', expected <reg>=<value>", assignment);
+		seed.gpr[index] = std::stoull(assignment.substr(separator + 1), nullptr, 0);
+	}
+
+	if (seed.gpr[rsp_id])
+		fatal("rsp cannot be seeded, the routine always runs on the sandbox stack");
+	return seed;
+}
+
+using trampoline_t = void (*)();
+
+// Switches to the sandbox register file and stack, calls the compiled routine and stores the resulting
+// registers back. Every host register except rsp is clobbered by the routine, so all of them are saved.
+//
+static trampoline_t build_trampoline(JitRuntime& rt, void* function, exec_context* context)
+{
+	jit_error_handler error_handler;
+	CodeHolder code;
+	code.init(rt.environment());
+	code.setErrorHandler(&error_handler);
+	x86::Assembler a(&code);
+
+	auto gpr_slot = [&](uint32_t id) {
+		return x86::qword_ptr(x86::rax, int32_t(offsetof(exec_context, gpr) + id * 8));
+	};
+	auto host_rsp_slot = x86::qword_ptr(x86::rax, int32_t(offsetof(exec_context, host_rsp)));
+
+	for (uint32_t id = 0; id < 16; id++)
+	{
+		if (id != rsp_id)
+			a.push(x86::gpq(id));
+	}
+
+	a.mov(x86::rax, uint64_t(context));
+	a.mov(host_rsp_slot, x86::rsp);
+	a.mov(x86::rsp, gpr_slot(rsp_id));
+	for (uint32_t id = 1; id < 16; id++)
+	{
+		if (id != rsp_id)
+			a.mov(x86::gpq(id), gpr_slot(id));
+	}
+	a.mov(x86::rax, gpr_slot(0));
+
+	Label target = a.newLabel();
+	a.call(x86::qword_ptr(target));
+
+	a.push(x86::rax);
+	a.mov(x86::rax, uint64_t(context));
+	for (uint32_t id = 1; id < 16; id++)
+	{
+		if (id != rsp_id)
+			a.mov(gpr_slot(id), x86::gpq(id));
+	}
+	a.pop(gpr_slot(0));
+	a.mov(gpr_slot(rsp_id), x86::rsp);
+	a.mov(x86::rsp, host_rsp_slot);
+
+	for (uint32_t id = 16; id-- > 0;)
+	{
+		if (id != rsp_id)
+			a.pop(x86::gpq(id));
+	}
+	a.ret();
+
+	a.align(kAlignData, 8);
+	a.bind(target);
+	a.embedUInt64(uint64_t(function));
+
+	trampoline_t trampoline;
+	if (rt.add(&trampoline, &code) != kErrorOk)
+		fatal("Failed to add the trampoline to the JIT runtime");
+	return trampoline;
+}
+
+static void* jit_routine(JitRuntime& rt, vtil::routine* rtn)
+{
+	jit_error_handler error_handler;
+	CodeHolder code;
+	code.init(rt.environment());
+	code.setErrorHandler(&error_handler);
+	compile_routine(rtn, code);
+
+	void* function;
+	if (rt.add(&function, &code) != kErrorOk)
+		fatal("Failed to add the routine to the JIT runtime");
+	return function;
+}
+
+struct exec_timing
+{
+	double ns_per_call = 0;
+	double cycles_per_call = 0;
+};
+
+static exec_timing run_jit(trampoline_t trampoline, exec_sandbox& sandbox, const exec_seed& seed, size_t iterations)
+{
+	using clock = std::chrono::steady_clock;
+
+	// Warm up caches and the branch predictor
+	//
+	sandbox.reset(seed);
+	trampoline();
+
+	auto t0 = clock::now();
+	uint64_t c0 = __rdtsc();
+	for (size_t i = 0; i < iterations; i++)
+	{
+		sandbox.reset(seed);
+		trampoline();
+	}
+	uint64_t c1 = __rdtsc();
+	double ns = std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+	return { ns / iterations, double(c1 - c0) / iterations };
+}
+
+// Runs the compiled code in a forked child, so a routine that faults on memory the seed does not provide
+// fails on its own instead of taking the process down. The child sends its timing and final registers
+// back through a pipe. Windows has no fork, the code runs in process there.
+//
+static exec_timing run_jit_isolated(trampoline_t trampoline, exec_sandbox& sandbox, const exec_seed& seed, size_t iterations)
+{
+#ifdef _WIN32
+	return run_jit(trampoline, sandbox, seed, iterations);
+#else
+	struct child_result
+	{
+		exec_timing timing;
+		uint64_t gpr[16];
+	};
+
+	int fds[2];
+	if (pipe(fds) != 0)
+		fatal("Could not create a pipe: %s", strerror(errno));
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		fatal("Could not fork: %s", strerror(errno));
+	}
+	if (pid == 0)
+	{
+		close(fds[0]);
+		child_result result;
+		result.timing = run_jit(trampoline, sandbox, seed, iterations);
+		memcpy(result.gpr, sandbox.context.gpr, sizeof(result.gpr));
+		_exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+	}
+	close(fds[1]);
+
+	child_result result;
+	size_t received = 0;
+	while (received < sizeof(result))
+	{
+		ssize_t n = read(fds[0], (char*)&result + received, sizeof(result) - received);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		received += size_t(n);
+	}
+	close(fds[0]);
+
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	if (WIFSIGNALED(status))
+		fatal("Compiled code was killed by signal %d (%s)", WTERMSIG(status), strsignal(WTERMSIG(status)));
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || received != sizeof(result))
+		fatal("Compiled code did not report its result");
+
+	memcpy(sandbox.context.gpr, result.gpr, sizeof(result.gpr));
+	return result.timing;
+#endif
+}
+
+struct emulation_result
+{
+	size_t blocks = 0;
+
+	// Whether the routine ran up to a vexit, only then the registers are its final state
+	bool exited = false;
+
+	// Final register values, unset where the value depends on memory the seed does not define
+	std::optional<uint64_t> gpr[16];
+};
+
+// Interprets the routine with VTIL's symbolic virtual machine, following branches as long as their
+// destination is constant
+//
+static emulation_result emulate(vtil::routine* rtn, const exec_seed& seed, size_t max_blocks)
+{
+	vtil::symbolic_vm vm;
+	for (uint32_t id = 0; id < 16; id++)
+	{
+		if (id == rsp_id)
+			continue;
+		vtil::register_desc reg{ vtil::register_physical, uint64_t(gpr_capstone_ids[id]), 64 };
+		vm.write_register(reg, vtil::symbolic::expression{ seed.gpr[id], 64 });
+	}
+
+	// The seeded stack values sit right above the return address, at the same offsets from the entry stack
+	// pointer as in exec_sandbox
+	//
+	auto sp = vm.read_register(vtil::REG_SP);
+	for (size_t i = 0; i < seed.stack.size(); i++)
+		vm.write_memory(sp + int64_t(8 * (i + 1)), vtil::symbolic::expression{ seed.stack[i], 64 }, 64);
+
+	auto resolve = [&](const vtil::operand& op) -> std::optional<uint64_t> {
+		if (op.is_immediate())
+			return op.imm().uval;
+		return vm.read_register(op.reg())->get<uint64_t>();
+	};
+
+	emulation_result result;
+	const vtil::basic_block* block = rtn->entry_point;
+	while (block && result.blocks < max_blocks)
+	{
+		result.blocks++;
+		auto [it, reason] = vm.run(block->begin());
+		if (it.is_end())
+			break;
+
+		const vtil::instruction& branch = *it;
+		if (*branch.base == vtil::ins::vexit)
+		{
+			result.exited = true;
+			break;
+		}
+		std::optional<uint64_t> destination;
+		if (*branch.base == vtil::ins::js)
+		{
+			if (auto condition = resolve(branch.operands[0]))
+				destination = resolve(branch.operands[*condition ? 1 : 2]);
+		}
+		else if (*branch.base == vtil::ins::jmp)
+		{
+			destination = resolve(branch.operands[0]);
+		}
+		else if (*branch.base == vtil::ins::vxcall && !block->next.empty())
+		{
+			destination = block->next[0]->entry_vip;
+		}
+
+		if (!destination)
+			break;
+		auto next = rtn->explored_blocks.find(*destination);
+		block = next != rtn->explored_blocks.end() ? next->second : nullptr;
+	}
+
+	for (uint32_t id = 0; id < 16; id++)
+	{
+		if (id == rsp_id)
+			continue;
+		vtil::register_desc reg{ vtil::register_physical, uint64_t(gpr_capstone_ids[id]), 64 };
+		result.gpr[id] = vm.read_register(reg)->get<uint64_t>();
+	}
+	return result;
+}
+
+static exec_timing run_emulator(vtil::routine* rtn, const exec_seed& seed, size_t iterations, size_t max_blocks, emulation_result& result)
+{
+	using clock = std::chrono::steady_clock;
+
+	auto t0 = clock::now();
+	uint64_t c0 = __rdtsc();
+	for (size_t i = 0; i < iterations; i++)
+		result = emulate(rtn, seed, max_blocks);
+	uint64_t c1 = __rdtsc();
+	double ns = std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+	return { ns / iterations, double(c1 - c0) / iterations };
+}
+
+static args::Command command_run(commands(), "run", "Execute a JIT-compiled .vtil file in a sandboxed context", [](args::Subparser& parser) {
+	// Argument handling
+	args::Positional<std::string> input(parser, "input", "Input .vtil file", args::Options::Required);
+	args::ValueFlag<std::string> argSeed(parser, "file", "JSON file with initial register values and stack contents", { "seed" });
+	args::ValueFlagList<std::string> argRegs(parser, "reg=value", "Initial register value, e.g. rcx=0x10", { 'r', "reg" });
+	args::ValueFlag<size_t> argIterations(parser, "N", "Number of timed executions", { 'n', "iterations" }, 1);
+	parser.Parse();
+
+	// Command implementation
+	auto seed = parse_seed(argSeed ? argSeed.Get() : "", argRegs.Get());
+	std::unique_ptr<vtil::routine> rtn{ vtil::load_routine(input.Get()) };
+
+	JitRuntime rt;
+	exec_sandbox sandbox;
+	auto trampoline = build_trampoline(rt, jit_routine(rt, rtn.get()), &sandbox.context);
+	auto timing = run_jit_isolated(trampoline, sandbox, seed, std::max<size_t>(argIterations.Get(), 1));
+
+	for (uint32_t id = 0; id < 16; id++)
+		log("%-4s = 0x%016llx\n", gpr_names[id], sandbox.context.gpr[id]);
+	log("\n[*] %.2f ns/call, %.2f cycles/call\n", timing.ns_per_call, timing.cycles_per_call);
+});
+
+static args::Command command_bench_exec(commands(), "bench-exec", "Compare JIT-compiled execution against emulation", [](args::Subparser& parser) {
+	// Argument handling
+	args::Positional<std::string> input(parser, "input", "Input .vtil file or directory", args::Options::Required);
+	args::ValueFlag<std::string> argSeed(parser, "file", "JSON file with initial register values and stack contents", { "seed" });
+	args::ValueFlagList<std::string> argRegs(parser, "reg=value", "Initial register value, e.g. rcx=0x10", { 'r', "reg" });
+	args::ValueFlag<size_t> argIterations(parser, "N", "Number of timed JIT executions", { 'n', "iterations" }, 10000);
+	args::ValueFlag<size_t> argEmuIterations(parser, "N", "Number of timed emulations", { "emu-iterations" }, 100);
+	args::ValueFlag<size_t> argMaxBlocks(parser, "N", "Maximum number of blocks emulated per run", { "max-blocks" }, 100000);
+	args::ValueFlag<std::string> argJson(parser, "file", "Write the results as JSON", { "json" });
+	args::Flag argVerify(parser, "verify", "Check the registers the compiled code leaves against emulation, fails if any differ", { "verify" });
+	args::Flag argNoPeephole(parser, "no-peephole", "Compile without the peephole pass", { "no-peephole" });
+	args::Flag argWideRegisters(parser, "wide-registers", "Compile every register at 64 bits, see compile --wide-registers", { "wide-registers" });
+	parser.Parse();
+
+	// Command implementation
+	auto seed = parse_seed(argSeed ? argSeed.Get() : "", argRegs.Get());
+	auto iterations = std::max<size_t>(argIterations.Get(), 1);
+	auto emu_iterations = std::max<size_t>(argEmuIterations.Get(), 1);
+	peephole_enabled = !argNoPeephole;
+	narrow_registers_enabled = !argWideRegisters;
+
+	size_t mismatched = 0;
+	size_t failed = 0;
+	json::value report = json::value::array();
+	log("%-40s %12s %12s %12s %8s %9s\n", "routine", "jit ns/call", "jit cyc/call", "emu ns/call", "blocks", "speedup");
+	for (const auto& file : enum_vtil_files(input.Get()))
+	{
+		try
+		{
+			std::unique_ptr<vtil::routine> rtn{ vtil::load_routine(file) };
+
+			JitRuntime rt;
+			exec_sandbox sandbox;
+			auto trampoline = build_trampoline(rt, jit_routine(rt, rtn.get()), &sandbox.context);
+			auto jit = run_jit_isolated(trampoline, sandbox, seed, iterations);
+
+			emulation_result emulated;
+			auto emu = run_emulator(rtn.get(), seed, emu_iterations, argMaxBlocks.Get(), emulated);
+			double speedup = jit.ns_per_call > 0 ? emu.ns_per_call / jit.ns_per_call : 0;
+			size_t blocks = emulated.blocks;
+
+			log("%-40s %12.2f %12.2f %12.2f %8llu %8.2fx\n",
+				file.filename().string(), jit.ns_per_call, jit.cycles_per_call, emu.ns_per_call, blocks, speedup);
+
+			// The sandbox still holds the registers of the last timed run, registers whose emulated value
+			// depends on unseeded memory cannot be checked
+			//
+			json::value mismatches = json::value::array();
+			size_t verified = 0;
+			if (argVerify && !emulated.exited)
+				log<CON_YLW>("%-40s not verified, emulation did not reach a vexit\n", "");
+			for (uint32_t id = 0; argVerify && emulated.exited && id < 16; id++)
+			{
+				if (!emulated.gpr[id])
+					continue;
+				verified++;
+				if (*emulated.gpr[id] == sandbox.context.gpr[id])
+					continue;
+
+				log<CON_RED>("%-40s %s = 0x%016llx, emulation gives 0x%016llx\n", "", gpr_names[id], sandbox.context.gpr[id], *emulated.gpr[id]);
+				mismatches.push_back(std::string(gpr_names[id]));
+			}
+			if (!mismatches.items.empty())
+				mismatched++;
+
+			auto& entry = report.push_back(json::value::object());
+			entry["routine"] = file.string();
+			entry["jit_ns_per_call"] = jit.ns_per_call;
+			entry["jit_cycles_per_call"] = jit.cycles_per_call;
+			entry["emu_ns_per_call"] = emu.ns_per_call;
+			entry["emu_cycles_per_call"] = emu.cycles_per_call;
+			entry["emu_blocks"] = uint64_t(blocks);
+			entry["speedup"] = speedup;
+			if (argVerify)
+			{
+				entry["verified"] = emulated.exited;
+				entry["verified_registers"] = uint64_t(verified);
+				entry["mismatches"] = std::move(mismatches);
+			}
+		}
+		catch (const std::exception& e)
+		{
+			log<CON_RED>("%-40s failed: %s\n", file.filename().string(), e.what());
+			failed++;
+
+			auto& entry = report.push_back(json::value::object());
+			entry["routine"] = file.string();
+			entry["error"] = std::string(e.what());
+		}
+	}
+
+	if (argJson)
+	{
+		std::ofstream out(argJson.Get());
+		if (!out.is_open())
+			fatal("Could not open '%s' for writing", argJson.Get());
+		out << report.dump(true) << std::endl;
+	}
+	if (mismatched)
+		fatal("%llu routines differ from emulation", mismatched);
+	if (argVerify && failed)
+		fatal("%llu routines could not be verified", failed);
+});
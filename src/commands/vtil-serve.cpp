@@ -0,0 +1,488 @@
+#include "vtil-utils.hpp"
+#include "lift.hpp"
+#include "jit.hpp"
+#include "json.hpp"
+#include "opt_pipeline.hpp"
+#include "vtil_pack.hpp"
+#include "bounded_queue.hpp"
+
+#include <vtil/compiler>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace vtil;
+using namespace logger;
+
+namespace fs = std::filesystem;
+
+// Peer that sent a request, responses are written back as single JSON lines. The standard output peer
+// has no descriptor.
+struct serve_client
+{
+	int fd = -1;
+	std::mutex lock;
+
+	explicit serve_client(int fd = -1)
+		: fd(fd)
+	{
+	}
+
+	~serve_client()
+	{
+#ifndef _WIN32
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+	void send(const json::value& response)
+	{
+		std::string line = response.dump() + '\n';
+		std::lock_guard _g(lock);
+		if (fd < 0)
+		{
+			fwrite(line.data(), 1, line.size(), stdout);
+			fflush(stdout);
+			return;
+		}
+#ifndef _WIN32
+		for (size_t written = 0; written < line.size();)
+		{
+			auto n = write(fd, line.data() + written, line.size() - written);
+			if (n <= 0)
+				return;
+			written += n;
+		}
+#endif
+	}
+};
+
+struct serve_request
+{
+	json::value body;
+	std::shared_ptr<serve_client> client;
+};
+
+// State kept warm between requests
+class serve_state
+{
+	struct cached_pe
+	{
+		fs::file_time_type modified;
+		std::shared_ptr<loaded_pe> pe;
+	};
+
+	std::mutex images_lock;
+	std::map<std::string, cached_pe> images;
+
+public:
+	asmjit::Environment environment;
+	std::atomic<size_t> requests = 0;
+	std::atomic<size_t> failures = 0;
+	std::atomic<bool> shutdown = false;
+
+	// Images are mapped once and reused until the file on disk changes
+	std::shared_ptr<loaded_pe> image(const std::string& path)
+	{
+		auto key = fs::canonical(path).string();
+		auto modified = fs::last_write_time(key);
+
+		std::lock_guard _g(images_lock);
+		auto& entry = images[key];
+		if (!entry.pe || entry.modified != modified)
+		{
+			entry.pe = std::make_shared<loaded_pe>(key);
+			entry.modified = modified;
+		}
+		return entry.pe;
+	}
+
+	size_t image_count()
+	{
+		std::lock_guard _g(images_lock);
+		return images.size();
+	}
+};
+
+static const std::string& string_field(const json::value& request, const char* name)
+{
+	auto field = request.find(name);
+	if (!field || !field->is_string())
+		fatal("Request is missing the string field '%s'", name);
+	return field->as_string();
+}
+
+static json::value serve_lift(serve_state& state, const json::value& request)
+{
+	auto pe = state.image(string_field(request, "exe"));
+	auto address_field = request.find("addr");
+	if (!address_field)
+		fatal("Request is missing the field 'addr'");
+	uint64_t address = address_field->as_u64();
+	if (!pe->contains(address))
+		fatal("Address 0x%llx not inside image", address);
+
+	std::unique_ptr<routine> rtn{ lift_function(*pe->input, address) };
+	auto& output = string_field(request, "output");
+	save_routine(rtn.get(), output);
+
+	json::value result = json::value::object();
+	result["output"] = output;
+	result["blocks"] = uint64_t(rtn->num_blocks());
+	result["instructions"] = uint64_t(rtn->num_instructions());
+	return result;
+}
+
+static json::value serve_opt(const json::value& request)
+{
+	std::unique_ptr<routine> rtn{ load_routine_ref(parse_routine_ref(string_field(request, "input"))) };
+	size_t before = rtn->num_instructions();
+
+	auto level = request.find("level");
+	auto passes = request.find("passes");
+	if (level && passes)
+		fatal("'level' and 'passes' are mutually exclusive");
+
+	bool completed = true;
+	if (level)
+		completed = run_pipeline(rtn.get(), preset_pipeline(int(level->as_u64())));
+	else if (passes)
+		completed = run_pipeline(rtn.get(), parse_pipeline(passes->as_string()));
+	else
+		optimizer::apply_all(rtn.get());
+
+	auto& output = string_field(request, "output");
+	save_routine(rtn.get(), output);
+
+	json::value result = json::value::object();
+	result["output"] = output;
+	result["instructions_before"] = uint64_t(before);
+	result["instructions_after"] = uint64_t(rtn->num_instructions());
+	result["blocks"] = uint64_t(rtn->num_blocks());
+	result["completed"] = completed;
+	return result;
+}
+
+static json::value serve_compile(serve_state& state, const json::value& request)
+{
+	thread_local std::unique_ptr<jit_context> context;
+	if (!context)
+		context = std::make_unique<jit_context>(state.environment);
+
+	std::unique_ptr<routine> rtn{ load_routine_ref(parse_routine_ref(string_field(request, "input"))) };
+	auto code = context->compile(rtn.get());
+
+	// Without an output path the code is returned inline as hex
+	//
+	json::value result = json::value::object();
+	result["size"] = uint64_t(code.size());
+	if (request.find("output"))
+	{
+		auto& output = string_field(request, "output");
+		write_file_bytes(output, code);
+		result["output"] = output;
+	}
+	else
+	{
+		std::string hex;
+		for (auto byte : code)
+			hex += format::str("%02x", byte);
+		result["code"] = hex;
+	}
+	return result;
+}
+
+static json::value serve_dump(const json::value& request)
+{
+	std::unique_ptr<routine> rtn{ load_routine_ref(parse_routine_ref(string_field(request, "input"))) };
+
+	json::value blocks = json::value::array();
+	for (auto& [vip, block] : rtn->explored_blocks)
+	{
+		json::value entry = json::value::object();
+		entry["vip"] = format::str("0x%llx", vip);
+
+		json::value instructions = json::value::array();
+		for (const auto& ins : *block)
+			instructions.push_back(ins.to_string());
+		entry["instructions"] = std::move(instructions);
+
+		json::value next = json::value::array();
+		for (auto successor : block->next)
+			next.push_back(format::str("0x%llx", successor->entry_vip));
+		entry["next"] = std::move(next);
+
+		blocks.push_back(std::move(entry));
+	}
+
+	json::value result = json::value::object();
+	result["entry"] = format::str("0x%llx", rtn->entry_point->entry_vip);
+	result["blocks"] = std::move(blocks);
+	return result;
+}
+
+static json::value serve_stats(serve_state& state)
+{
+	auto& cache = lift_cache::instance();
+	json::value result = json::value::object();
+	result["requests"] = uint64_t(state.requests);
+	result["failures"] = uint64_t(state.failures);
+	result["images"] = uint64_t(state.image_count());
+	result["lift_cache_hits"] = uint64_t(cache.hits);
+	result["lift_cache_misses"] = uint64_t(cache.misses);
+	result["peak_memory_bytes"] = peak_memory_bytes();
+	return result;
+}
+
+// Runs a single request, every response echoes the request id and reports success in "ok"
+static json::value handle_request(serve_state& state, const json::value& request)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	json::value response;
+	try
+	{
+		if (!request.is_object())
+			fatal("Request is not a JSON object");
+
+		auto& command = string_field(request, "command");
+		if (command == "lift")
+			response = serve_lift(state, request);
+		else if (command == "opt")
+			response = serve_opt(request);
+		else if (command == "compile")
+			response = serve_compile(state, request);
+		else if (command == "dump")
+			response = serve_dump(request);
+		else if (command == "stats")
+			response = serve_stats(state);
+		else if (command == "shutdown")
+		{
+			state.shutdown = true;
+			response = json::value::object();
+		}
+		else
+			fatal("Unknown command '%s'", command);
+		response["ok"] = true;
+	}
+	catch (const std::exception& e)
+	{
+		state.failures++;
+		response = json::value::object();
+		response["ok"] = false;
+		response["error"] = e.what();
+	}
+
+	if (auto id = request.is_object() ? request.find("id") : nullptr)
+		response["id"] = *id;
+	response["milliseconds"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	state.requests++;
+	return response;
+}
+
+// Queues a request line, malformed lines are answered right away. Returns false once the client asked
+// for a shutdown, nothing it sends afterwards is read.
+static bool queue_request(const std::string& line, const std::shared_ptr<serve_client>& client, bounded_queue<serve_request>& queue)
+{
+	if (line.find_first_not_of(" \t\r") == std::string::npos)
+		return true;
+
+	json::value body;
+	try
+	{
+		body = json::parse(line);
+	}
+	catch (const std::exception& e)
+	{
+		json::value response = json::value::object();
+		response["ok"] = false;
+		response["error"] = e.what();
+		client->send(response);
+		return true;
+	}
+
+	auto command = body.is_object() ? body.find("command") : nullptr;
+	bool shutdown = command && command->is_string() && command->as_string() == "shutdown";
+	queue.push({ std::move(body), client });
+	return !shutdown;
+}
+
+static void read_requests(std::istream& stream, const std::shared_ptr<serve_client>& client, bounded_queue<serve_request>& queue, serve_state& state)
+{
+	for (std::string line; !state.shutdown && std::getline(stream, line);)
+	{
+		if (!queue_request(line, client, queue))
+			break;
+	}
+}
+
+#ifndef _WIN32
+// Line reader over a connected socket
+static void read_socket_requests(const std::shared_ptr<serve_client>& client, bounded_queue<serve_request>& queue, serve_state& state)
+{
+	std::string buffer;
+	char chunk[4096];
+	while (!state.shutdown)
+	{
+		auto n = read(client->fd, chunk, sizeof(chunk));
+		if (n <= 0)
+			break;
+		buffer.append(chunk, n);
+
+		size_t begin = 0;
+		for (size_t end; (end = buffer.find('\n', begin)) != std::string::npos; begin = end + 1)
+		{
+			if (!queue_request(buffer.substr(begin, end - begin), client, queue))
+				return;
+		}
+		buffer.erase(0, begin);
+	}
+}
+
+// Connections whose reader is still running, readers are detached and remove themselves when their
+// client disconnects, so a long running server only holds threads for open connections
+struct serve_connections
+{
+	std::mutex lock;
+	std::condition_variable closed;
+	std::unordered_map<serve_client*, std::weak_ptr<serve_client>> open;
+
+	void start(const std::shared_ptr<serve_client>& client, bounded_queue<serve_request>& queue, serve_state& state)
+	{
+		{
+			std::lock_guard _g(lock);
+			open.emplace(client.get(), client);
+		}
+		std::thread([this, client, &queue, &state]() {
+			read_socket_requests(client, queue, state);
+
+			// Nothing may touch this object after the lock is released, the server may be gone by then
+			std::lock_guard _g(lock);
+			open.erase(client.get());
+			closed.notify_all();
+		}).detach();
+	}
+
+	// Unblocks the readers of connections that are still open and waits for them to finish
+	void close_all()
+	{
+		std::unique_lock _g(lock);
+		for (auto& [ptr, client] : open)
+		{
+			if (auto alive = client.lock())
+				::shutdown(alive->fd, SHUT_RD);
+		}
+		closed.wait(_g, [&] { return open.empty(); });
+	}
+};
+#endif
+
+static args::Command serve(commands(), "serve", "Serve lift, opt, compile and dump requests as JSON lines", [](args::Subparser& parser) {
+	// Argument handling
+	args::ValueFlag<std::string> socketPath(parser, "path", "Listen on a Unix socket instead of reading requests from stdin", { "socket" });
+	args::ValueFlag<size_t> jobs(parser, "jobs", "Number of requests handled concurrently", { 'j', "jobs" }, default_jobs());
+	args::ValueFlag<size_t> queueSize(parser, "requests", "Number of requests accepted ahead of the workers", { "queue-size" }, 256);
+	parser.Parse();
+
+	// Command implementation
+	serve_state state;
+	asmjit::JitRuntime rt;
+	state.environment = rt.environment();
+
+	bounded_queue<serve_request> queue(queueSize.Get());
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < std::max<size_t>(jobs.Get(), 1); i++)
+	{
+		workers.emplace_back([&]() {
+			while (auto request = queue.pop())
+			{
+				request->client->send(handle_request(state, request->body));
+				if (state.shutdown)
+					queue.close();
+			}
+		});
+	}
+
+	if (!socketPath)
+	{
+		// Responses own standard output, so the usual progress output is silenced
+		//
+		verbosity = verbosity_level::quiet;
+		read_requests(std::cin, std::make_shared<serve_client>(), queue, state);
+	}
+	else
+	{
+#ifdef _WIN32
+		fatal("Unix sockets are not supported on this platform");
+#else
+		signal(SIGPIPE, SIG_IGN);
+
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+			fatal("Could not create socket");
+
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if (socketPath.Get().size() >= sizeof(address.sun_path))
+			fatal("Socket path '%s' is too long", socketPath.Get());
+		strcpy(address.sun_path, socketPath.Get().c_str());
+
+		unlink(address.sun_path);
+		if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+			fatal("Could not listen on '%s'", socketPath.Get());
+		log_at(verbosity_level::normal, "[*] Listening on '%s' with %llu workers\n", socketPath.Get(), workers.size());
+
+		// A shutdown request closes the listener to end the accept loop
+		//
+		std::thread watchdog([&]() {
+			while (!state.shutdown)
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			::shutdown(listener, SHUT_RDWR);
+		});
+
+		serve_connections connections;
+		while (!state.shutdown)
+		{
+			int fd = accept(listener, nullptr, nullptr);
+			if (fd >= 0)
+			{
+				connections.start(std::make_shared<serve_client>(fd), queue, state);
+				continue;
+			}
+			if (state.shutdown || errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// Out of descriptors or memory, retrying right away would only spin
+			//
+			log<CON_RED>("[*] accept failed: %s\n", strerror(errno));
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		connections.close_all();
+
+		watchdog.join();
+		close(listener);
+		unlink(address.sun_path);
+#endif
+	}
+
+	queue.close();
+	for (auto& worker : workers)
+		worker.join();
+});
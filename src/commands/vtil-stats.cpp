@@ -0,0 +1,264 @@
+#include "vtil-utils.hpp"
+#include "json.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+
+using namespace vtil;
+using namespace logger;
+
+namespace fs = std::filesystem;
+
+// Number of largest blocks kept for the report
+constexpr size_t largest_block_count = 16;
+
+struct block_size
+{
+	std::string routine;
+	vip_t vip;
+	size_t instructions;
+};
+
+struct routine_stats
+{
+	fs::path input;
+	bool success = false;
+	std::string error;
+
+	size_t blocks = 0;
+	size_t instructions = 0;
+	size_t edges = 0;
+	size_t exits = 0;
+	size_t max_fan_out = 0;
+	size_t max_block = 0;
+
+	std::map<std::string, size_t> opcodes;
+	std::map<size_t, size_t> fan_out;
+	std::map<std::string, size_t> register_classes;
+	std::map<size_t, size_t> register_widths;
+	std::vector<block_size> largest_blocks;
+};
+
+// Special registers first, then block-local temporaries, then routine wide physical and virtual registers
+static const char* register_class(const register_desc& reg)
+{
+	if (reg.is_flags())
+		return "flags";
+	if (reg.is_stack_pointer())
+		return "stack_pointer";
+	if (reg.is_image_base())
+		return "image_base";
+	if (reg.is_undefined())
+		return "undefined";
+	if (reg.is_internal())
+		return "internal";
+	if (reg.is_local())
+		return "temporary";
+	return reg.is_physical() ? "physical" : "virtual";
+}
+
+static void keep_largest(std::vector<block_size>& blocks)
+{
+	std::sort(blocks.begin(), blocks.end(), [](const block_size& a, const block_size& b) {
+		return a.instructions > b.instructions;
+	});
+	if (blocks.size() > largest_block_count)
+		blocks.resize(largest_block_count);
+}
+
+static void collect(routine_stats& stats)
+{
+	std::unique_ptr<routine> rtn{ load_routine(stats.input) };
+	std::string name = stats.input.string();
+
+	for (auto& [vip, block] : rtn->explored_blocks)
+	{
+		stats.blocks++;
+		stats.instructions += block->size();
+		stats.max_block = std::max(stats.max_block, block->size());
+
+		size_t fan_out = block->next.size();
+		stats.edges += fan_out;
+		stats.exits += fan_out == 0;
+		stats.max_fan_out = std::max(stats.max_fan_out, fan_out);
+		stats.fan_out[fan_out]++;
+
+		for (auto& ins : *block)
+		{
+			stats.opcodes[ins.base->name]++;
+			for (auto& op : ins.operands)
+			{
+				if (!op.is_register())
+					continue;
+				stats.register_classes[register_class(op.reg())]++;
+				stats.register_widths[op.reg().bit_count]++;
+			}
+		}
+
+		stats.largest_blocks.push_back({ name, vip, block->size() });
+	}
+	keep_largest(stats.largest_blocks);
+}
+
+template<typename K>
+static json::value histogram(const std::map<K, size_t>& counts)
+{
+	json::value result = json::value::object();
+	for (auto& [key, count] : counts)
+	{
+		if constexpr (std::is_same_v<K, std::string>)
+			result[key] = uint64_t(count);
+		else
+			result[std::to_string(key)] = uint64_t(count);
+	}
+	return result;
+}
+
+template<typename K>
+static void merge(std::map<K, size_t>& into, const std::map<K, size_t>& from)
+{
+	for (auto& [key, count] : from)
+		into[key] += count;
+}
+
+static void write_csv(const fs::path& path, const std::vector<routine_stats>& results)
+{
+	std::ofstream out(path);
+	if (!out.is_open())
+		fatal("Failed to open CSV file '%s'", path.string());
+
+	out << "routine,blocks,instructions,edges,exits,max_fan_out,max_block\n";
+	for (const auto& stats : results)
+	{
+		if (!stats.success)
+			continue;
+
+		// Quote the path, doubling any quotes inside it
+		//
+		std::string quoted = "\"";
+		for (char c : stats.input.string())
+			quoted += c == '"' ? std::string("\"\"") : std::string(1, c);
+		quoted += '"';
+
+		out << quoted << ',' << stats.blocks << ',' << stats.instructions << ',' << stats.edges << ','
+			<< stats.exits << ',' << stats.max_fan_out << ',' << stats.max_block << '\n';
+	}
+}
+
+static args::Command stats(commands(), "stats", "Collect statistics over .vtil files", [](args::Subparser& parser) {
+	// Argument handling
+	args::Positional<std::string> input(parser, "input", "Input .vtil file or directory", args::Options::Required);
+	args::ValueFlag<std::string> csv(parser, "file", "Write one row of statistics per routine as CSV", { "csv" });
+	args::ValueFlag<std::string> json_output(parser, "file", "Write the aggregated statistics as JSON", { "json" });
+	args::ValueFlag<size_t> jobs(parser, "jobs", "Number of worker threads", { 'j', "jobs" }, default_jobs());
+	parser.Parse();
+
+	// Command implementation
+	auto inputs = enum_vtil_files(input.Get());
+	if (inputs.empty())
+		fatal("No .vtil files found in '%s'", input.Get());
+
+	std::vector<routine_stats> results(inputs.size());
+	auto start = std::chrono::steady_clock::now();
+	parallel_for(inputs.size(), jobs.Get(), [&](size_t index) {
+		auto& stats = results[index];
+		stats.input = inputs[index];
+		try
+		{
+			collect(stats);
+			stats.success = true;
+		}
+		catch (const std::exception& e)
+		{
+			stats.error = e.what();
+			log<CON_RED>("%s: %s\n", stats.input.string(), stats.error);
+		}
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Aggregate
+	//
+	routine_stats total;
+	size_t succeeded = 0;
+	for (auto& stats : results)
+	{
+		if (!stats.success)
+			continue;
+		succeeded++;
+		total.blocks += stats.blocks;
+		total.instructions += stats.instructions;
+		total.edges += stats.edges;
+		total.exits += stats.exits;
+		total.max_fan_out = std::max(total.max_fan_out, stats.max_fan_out);
+		total.max_block = std::max(total.max_block, stats.max_block);
+		merge(total.opcodes, stats.opcodes);
+		merge(total.fan_out, stats.fan_out);
+		merge(total.register_classes, stats.register_classes);
+		merge(total.register_widths, stats.register_widths);
+		total.largest_blocks.insert(total.largest_blocks.end(), stats.largest_blocks.begin(), stats.largest_blocks.end());
+	}
+	keep_largest(total.largest_blocks);
+
+	log_at(verbosity_level::normal, "[*] Scanned %llu/%llu routines in %.2fs: %llu blocks, %llu instructions, %llu edges\n",
+		succeeded, results.size(), seconds, total.blocks, total.instructions, total.edges);
+	if (succeeded)
+	{
+		log_at(verbosity_level::normal, "[*] Average: %.1f blocks, %.1f instructions per routine, %.2f instructions per block\n",
+			double(total.blocks) / succeeded, double(total.instructions) / succeeded, total.blocks ? double(total.instructions) / total.blocks : 0.0);
+	}
+
+	// Most frequent opcodes first
+	//
+	std::vector<std::pair<std::string, size_t>> opcodes(total.opcodes.begin(), total.opcodes.end());
+	std::stable_sort(opcodes.begin(), opcodes.end(), [](const auto& a, const auto& b) {
+		return a.second > b.second;
+	});
+	if (is_verbose(verbosity_level::verbose))
+	{
+		for (auto& [name, count] : opcodes)
+			log("  %-8s %10llu %6.2f%%\n", name, count, 100.0 * count / std::max<size_t>(total.instructions, 1));
+	}
+
+	if (csv)
+		write_csv(csv.Get(), results);
+
+	if (json_output)
+	{
+		json::value report = json::value::object();
+		report["routines"] = uint64_t(succeeded);
+		report["failed"] = uint64_t(results.size() - succeeded);
+		report["blocks"] = uint64_t(total.blocks);
+		report["instructions"] = uint64_t(total.instructions);
+		report["edges"] = uint64_t(total.edges);
+		report["exits"] = uint64_t(total.exits);
+		report["max_fan_out"] = uint64_t(total.max_fan_out);
+		report["max_block"] = uint64_t(total.max_block);
+		report["seconds"] = seconds;
+
+		json::value opcode_histogram = json::value::object();
+		for (auto& [name, count] : opcodes)
+			opcode_histogram[name] = uint64_t(count);
+		report["opcodes"] = std::move(opcode_histogram);
+		report["fan_out"] = histogram(total.fan_out);
+		report["register_classes"] = histogram(total.register_classes);
+		report["register_widths"] = histogram(total.register_widths);
+
+		json::value largest = json::value::array();
+		for (auto& block : total.largest_blocks)
+		{
+			json::value entry = json::value::object();
+			entry["routine"] = block.routine;
+			entry["vip"] = format::str("0x%llx", block.vip);
+			entry["instructions"] = uint64_t(block.instructions);
+			largest.push_back(std::move(entry));
+		}
+		report["largest_blocks"] = std::move(largest);
+
+		std::ofstream out(json_output.Get());
+		if (!out.is_open())
+			fatal("Failed to open JSON file '%s'", json_output.Get());
+		out << report.dump(true) << '\n';
+	}
+});
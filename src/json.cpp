@@ -0,0 +1,373 @@
+#include "json.hpp"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace json
+{
+value::value(double d)
+	: type(kind::number)
+{
+	char buffer[64];
+	if (std::isfinite(d))
+		snprintf(buffer, sizeof(buffer), "%.17g", d);
+	else
+		snprintf(buffer, sizeof(buffer), "0");
+	text = buffer;
+}
+
+value::value(int64_t i)
+	: type(kind::number)
+	, text(std::to_string(i))
+{
+}
+
+value::value(uint64_t u)
+	: type(kind::number)
+	, text(std::to_string(u))
+{
+}
+
+const value* value::find(const std::string& key) const
+{
+	if (type != kind::object)
+		return nullptr;
+	for (auto& [name, member] : members)
+	{
+		if (name == key)
+			return &member;
+	}
+	return nullptr;
+}
+
+value& value::operator[](const std::string& key)
+{
+	if (type == kind::null)
+		type = kind::object;
+	if (type != kind::object)
+		throw std::runtime_error("JSON value is not an object");
+
+	for (auto& [name, member] : members)
+	{
+		if (name == key)
+			return member;
+	}
+	return members.emplace_back(key, value{}).second;
+}
+
+value& value::push_back(value v)
+{
+	if (type == kind::null)
+		type = kind::array;
+	if (type != kind::array)
+		throw std::runtime_error("JSON value is not an array");
+	return items.emplace_back(std::move(v));
+}
+
+double value::as_double() const
+{
+	if (type != kind::number && type != kind::string)
+		throw std::runtime_error("JSON value is not a number");
+	return strtod(text.c_str(), nullptr);
+}
+
+uint64_t value::as_u64() const
+{
+	if (type != kind::number && type != kind::string)
+		throw std::runtime_error("JSON value is not an integer");
+
+	char* end = nullptr;
+	uint64_t result = (!text.empty() && text[0] == '-') ? uint64_t(strtoll(text.c_str(), &end, 0)) : strtoull(text.c_str(), &end, 0);
+	if (text.empty() || *end)
+		throw std::runtime_error("Invalid JSON integer '" + text + "'");
+	return result;
+}
+
+const std::string& value::as_string() const
+{
+	if (type != kind::string)
+		throw std::runtime_error("JSON value is not a string");
+	return text;
+}
+
+static void dump_string(std::string& out, const std::string& s)
+{
+	out += '"';
+	for (char c : s)
+	{
+		switch (c)
+		{
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if ((uint8_t)c < 0x20)
+			{
+				char buffer[8];
+				snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+				out += buffer;
+			}
+			else
+			{
+				out += c;
+			}
+		}
+	}
+	out += '"';
+}
+
+void value::dump(std::string& out, bool pretty, int depth) const
+{
+	auto newline = [&](int level) {
+		if (pretty)
+		{
+			out += '\n';
+			out.append(level * 2, ' ');
+		}
+	};
+
+	switch (type)
+	{
+	case kind::null:
+		out += "null";
+		break;
+	case kind::boolean:
+		out += boolean ? "true" : "false";
+		break;
+	case kind::number:
+		out += text;
+		break;
+	case kind::string:
+		dump_string(out, text);
+		break;
+	case kind::array:
+		out += '[';
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			if (i)
+				out += ',';
+			newline(depth + 1);
+			items[i].dump(out, pretty, depth + 1);
+		}
+		if (!items.empty())
+			newline(depth);
+		out += ']';
+		break;
+	case kind::object:
+		out += '{';
+		for (size_t i = 0; i < members.size(); i++)
+		{
+			if (i)
+				out += ',';
+			newline(depth + 1);
+			dump_string(out, members[i].first);
+			out += pretty ? ": " : ":";
+			members[i].second.dump(out, pretty, depth + 1);
+		}
+		if (!members.empty())
+			newline(depth);
+		out += '}';
+		break;
+	}
+}
+
+std::string value::dump(bool pretty) const
+{
+	std::string out;
+	dump(out, pretty, 0);
+	return out;
+}
+
+struct parser
+{
+	const std::string& text;
+	size_t pos = 0;
+
+	[[noreturn]] void error(const char* what)
+	{
+		throw std::runtime_error("JSON parse error at offset " + std::to_string(pos) + ": " + what);
+	}
+
+	void skip_ws()
+	{
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+			pos++;
+	}
+
+	bool consume(const char* literal)
+	{
+		size_t length = strlen(literal);
+		if (text.compare(pos, length, literal) != 0)
+			return false;
+		pos += length;
+		return true;
+	}
+
+	std::string parse_string()
+	{
+		std::string result;
+		pos++;
+		while (true)
+		{
+			if (pos >= text.size())
+				error("unterminated string");
+
+			char c = text[pos++];
+			if (c == '"')
+				return result;
+			if (c != '\\')
+			{
+				result += c;
+				continue;
+			}
+
+			if (pos >= text.size())
+				error("unterminated escape");
+			switch (text[pos++])
+			{
+			case '"': result += '"'; break;
+			case '\\': result += '\\'; break;
+			case '/': result += '/'; break;
+			case 'b': result += '\b'; break;
+			case 'f': result += '\f'; break;
+			case 'n': result += '\n'; break;
+			case 'r': result += '\r'; break;
+			case 't': result += '\t'; break;
+			case 'u':
+			{
+				if (pos + 4 > text.size())
+					error("truncated unicode escape");
+				uint32_t cp = strtoul(text.substr(pos, 4).c_str(), nullptr, 16);
+				pos += 4;
+
+				// Encode as UTF-8, surrogate pairs are not combined
+				if (cp < 0x80)
+				{
+					result += char(cp);
+				}
+				else if (cp < 0x800)
+				{
+					result += char(0xC0 | (cp >> 6));
+					result += char(0x80 | (cp & 0x3F));
+				}
+				else
+				{
+					result += char(0xE0 | (cp >> 12));
+					result += char(0x80 | ((cp >> 6) & 0x3F));
+					result += char(0x80 | (cp & 0x3F));
+				}
+				break;
+			}
+			default:
+				error("invalid escape");
+			}
+		}
+	}
+
+	value parse_value()
+	{
+		skip_ws();
+		if (pos >= text.size())
+			error("unexpected end of input");
+
+		char c = text[pos];
+		if (c == '{')
+		{
+			value v = value::object();
+			pos++;
+			skip_ws();
+			if (pos < text.size() && text[pos] == '}')
+			{
+				pos++;
+				return v;
+			}
+			while (true)
+			{
+				skip_ws();
+				if (pos >= text.size() || text[pos] != '"')
+					error("expected member name");
+				std::string key = parse_string();
+				skip_ws();
+				if (pos >= text.size() || text[pos] != ':')
+					error("expected ':'");
+				pos++;
+				v.members.emplace_back(std::move(key), parse_value());
+				skip_ws();
+				if (pos < text.size() && text[pos] == ',')
+				{
+					pos++;
+					continue;
+				}
+				if (pos < text.size() && text[pos] == '}')
+				{
+					pos++;
+					return v;
+				}
+				error("expected ',' or '}'");
+			}
+		}
+		if (c == '[')
+		{
+			value v = value::array();
+			pos++;
+			skip_ws();
+			if (pos < text.size() && text[pos] == ']')
+			{
+				pos++;
+				return v;
+			}
+			while (true)
+			{
+				v.items.push_back(parse_value());
+				skip_ws();
+				if (pos < text.size() && text[pos] == ',')
+				{
+					pos++;
+					continue;
+				}
+				if (pos < text.size() && text[pos] == ']')
+				{
+					pos++;
+					return v;
+				}
+				error("expected ',' or ']'");
+			}
+		}
+		if (c == '"')
+			return value{ parse_string() };
+		if (consume("true"))
+			return value{ true };
+		if (consume("false"))
+			return value{ false };
+		if (consume("null"))
+			return value{};
+
+		size_t start = pos;
+		while (pos < text.size() && (isdigit((uint8_t)text[pos]) || strchr("+-.eE", text[pos])))
+			pos++;
+		if (start == pos)
+			error("unexpected character");
+
+		value v;
+		v.type = value::kind::number;
+		v.text = text.substr(start, pos - start);
+		return v;
+	}
+};
+
+value parse(const std::string& text)
+{
+	parser p{ text };
+	value v = p.parse_value();
+	p.skip_ws();
+	if (p.pos != text.size())
+		p.error("trailing characters");
+	return v;
+}
+} // namespace json
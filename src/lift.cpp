@@ -0,0 +1,335 @@
+#include "lift.hpp"
+#include "vtil-utils.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+using namespace vtil;
+
+loaded_pe::loaded_pe(const std::filesystem::path& path)
+	: file(path)
+{
+	image.emplace(pe_header_bytes(file.data(), file.size()));
+	if (!image->is_valid() || !image->is_pe64())
+		fatal("Image is not a 64-bit PE file");
+	input.emplace(*image, file.data(), file.size());
+}
+
+bool loaded_pe::contains(uint64_t address) const
+{
+	return address >= image->get_image_base() && address < image->get_image_base() + image->get_image_size();
+}
+
+static routine* finish_routine(routine* rtn)
+{
+	rtn->routine_convention = amd64::default_call_convention;
+	rtn->routine_convention.purge_stack = true;
+	return rtn;
+}
+
+routine* lift_function(pe_input& input, uint64_t address)
+{
+	amd64_recursive_descent rd(&input, address);
+	rd.explore();
+	return finish_routine(rd.entry->owner);
+}
+
+// Shared state of one explore_function call. Branch targets are claimed through basic_block::fork, which
+// only hands a block to the thread that created it, so every block is lifted once. The routine's own
+// lock keeps concurrent forks consistent.
+//
+class function_explorer
+{
+	using clock = std::chrono::steady_clock;
+
+	struct task
+	{
+		basic_block* block;
+		uint64_t source;
+	};
+
+	pe_input& input;
+	lift_budget budget;
+	clock::time_point deadline;
+
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::deque<task> tasks;
+	size_t active = 0;
+	std::exception_ptr error;
+
+	std::atomic<size_t> blocks = 0;
+	std::atomic<size_t> instructions = 0;
+	std::atomic<const char*> exhausted = nullptr;
+
+	std::mutex unexplored_lock;
+	std::vector<unexplored_edge> unexplored;
+
+	// Records the first budget to run out, always returns false
+	bool stop(const char* reason)
+	{
+		const char* expected = nullptr;
+		exhausted.compare_exchange_strong(expected, reason);
+		return false;
+	}
+
+	bool within_budget()
+	{
+		if (exhausted)
+			return false;
+		if (budget.max_instructions && instructions >= budget.max_instructions)
+			return stop("max-instructions");
+		if (budget.timeout.count() && clock::now() >= deadline)
+			return stop("timeout");
+		return true;
+	}
+
+	// Ends the block by leaving the routine at target
+	void cut(basic_block* block, uint64_t source, uint64_t target)
+	{
+		block->vexit(target);
+		std::lock_guard _g(unexplored_lock);
+		unexplored.push_back({ source, target });
+	}
+
+	void push(const task& t)
+	{
+		std::lock_guard _g(lock);
+		tasks.push_back(t);
+		wakeup.notify_one();
+	}
+
+	void lift_block(const task& t)
+	{
+		basic_block* block = t.block;
+		if (budget.max_blocks && blocks++ >= budget.max_blocks)
+			stop("max-blocks");
+		if (!within_budget())
+			return cut(block, t.source, block->entry_vip);
+
+		vip_t vip = block->entry_vip;
+		while (!block->is_complete())
+		{
+			if (!input.is_valid(vip))
+			{
+				block->vexit(vip);
+				break;
+			}
+			if (!within_budget())
+				return cut(block, block->entry_vip, vip);
+
+			size_t length = amd64_lifter::process(block, vip, input.get_at(vip));
+			if (!length)
+				fatal("Failed to lift instruction at 0x%llx", vip);
+			instructions++;
+			vip += length;
+		}
+
+		// Constant branch targets become new tasks, calls continue after the call instruction
+		//
+		const instruction& last = block->back();
+		std::vector<vip_t> targets;
+		for (int index : last.base->branch_operands_vip)
+		{
+			if (last.operands[index].is_immediate())
+				targets.push_back(last.operands[index].imm().u64);
+		}
+		if (last.base == &ins::vxcall)
+			targets.push_back(vip);
+
+		for (vip_t target : targets)
+		{
+			if (basic_block* next = block->fork(target))
+				push({ next, block->entry_vip });
+		}
+	}
+
+	void worker()
+	{
+		while (true)
+		{
+			task t;
+			{
+				std::unique_lock _g(lock);
+				wakeup.wait(_g, [&] { return !tasks.empty() || active == 0; });
+				if (tasks.empty())
+					return;
+				t = tasks.front();
+				tasks.pop_front();
+				active++;
+			}
+
+			try
+			{
+				lift_block(t);
+			}
+			catch (...)
+			{
+				// Keep the first error, the remaining blocks are cut off so the workers wind down
+				std::lock_guard _g(lock);
+				if (!error)
+					error = std::current_exception();
+				stop("error");
+			}
+
+			std::lock_guard _g(lock);
+			if (--active == 0 && tasks.empty())
+				wakeup.notify_all();
+		}
+	}
+
+public:
+	function_explorer(pe_input& input, const lift_budget& budget)
+		: input(input)
+		, budget(budget)
+	{
+	}
+
+	explored_function run(uint64_t address, size_t jobs)
+	{
+		deadline = clock::now() + budget.timeout;
+		basic_block* entry = basic_block::begin(address);
+		tasks.push_back({ entry, address });
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < jobs; i++)
+			threads.emplace_back(&function_explorer::worker, this);
+		worker();
+		for (auto& thread : threads)
+			thread.join();
+
+		routine* rtn = entry->owner;
+		if (error)
+		{
+			delete rtn;
+			std::rethrow_exception(error);
+		}
+
+		std::sort(unexplored.begin(), unexplored.end(), [](const unexplored_edge& a, const unexplored_edge& b) {
+			return std::tie(a.source, a.target) < std::tie(b.source, b.target);
+		});
+		return { finish_routine(rtn), std::move(unexplored), exhausted };
+	}
+};
+
+explored_function explore_function(pe_input& input, uint64_t address, const explore_options& options)
+{
+	if (options.jobs <= 1 && options.budget.unlimited())
+		return { lift_function(input, address) };
+
+	function_explorer explorer(input, options.budget);
+	return explorer.run(address, std::max<size_t>(options.jobs, 1));
+}
+
+void save_unexplored(const std::vector<unexplored_edge>& edges, const std::filesystem::path& path)
+{
+	std::ofstream out(path);
+	if (!out.is_open())
+		fatal("Could not open '%s' for writing", path.string());
+	for (const auto& edge : edges)
+		out << format::str("0x%llx -> 0x%llx\n", edge.source, edge.target);
+}
+
+std::vector<uint64_t> enum_pdata_functions(const pe_input& input)
+{
+	constexpr size_t image_directory_entry_exception = 3;
+	constexpr uint8_t unw_flag_chaininfo = 0x4;
+
+	std::vector<uint64_t> functions;
+	auto [rva, size] = input.data_directory(image_directory_entry_exception);
+	for (uint64_t entry = rva; entry + 12 <= uint64_t(rva) + size; entry += 12)
+	{
+		auto begin = input.read<uint32_t>(entry);
+		auto unwind_info = input.read<uint32_t>(entry + 8);
+		if (!begin || (input.read<uint8_t>(unwind_info) >> 3) & unw_flag_chaininfo)
+			continue;
+		functions.push_back(input.image_base + begin);
+	}
+	return functions;
+}
+
+std::vector<std::pair<uint64_t, std::string>> enum_exports(const pe_input& input)
+{
+	constexpr size_t image_directory_entry_export = 0;
+
+	std::vector<std::pair<uint64_t, std::string>> exports;
+	auto [rva, size] = input.data_directory(image_directory_entry_export);
+	if (!rva)
+		return exports;
+
+	auto function_count = input.read<uint32_t>(rva + 0x14);
+	auto name_count = input.read<uint32_t>(rva + 0x18);
+	auto functions = input.read<uint32_t>(rva + 0x1C);
+	auto names = input.read<uint32_t>(rva + 0x20);
+	auto ordinals = input.read<uint32_t>(rva + 0x24);
+
+	std::vector<std::string> function_names(function_count);
+	for (uint32_t i = 0; i < name_count; i++)
+	{
+		auto ordinal = input.read<uint16_t>(ordinals + i * 2ull);
+		if (ordinal >= function_count)
+			continue;
+
+		std::string name;
+		for (uint64_t p = input.read<uint32_t>(names + i * 4ull); char c = input.read<char>(p); p++)
+			name += c;
+		function_names[ordinal] = name;
+	}
+
+	for (uint32_t i = 0; i < function_count; i++)
+	{
+		auto function = input.read<uint32_t>(functions + i * 4ull);
+		if (!function || (function >= rva && function < uint64_t(rva) + size) || !input.is_executable(function))
+			continue;
+		exports.emplace_back(input.image_base + function, function_names[i]);
+	}
+	return exports;
+}
+
+std::string function_file_name(uint64_t address, const std::string& name)
+{
+	if (name.empty())
+		return format::str("sub_%llx", address);
+
+	std::string result = name;
+	for (auto& c : result)
+	{
+		if (!isalnum((uint8_t)c) && c != '_' && c != '.' && c != '-')
+			c = '_';
+	}
+	return result;
+}
+
+std::vector<std::string> function_file_names(const std::map<uint64_t, std::string>& functions)
+{
+	auto key = [](std::string name) {
+		for (auto& c : name)
+			c = char(tolower((uint8_t)c));
+		return name;
+	};
+
+	std::vector<std::string> names;
+	std::unordered_map<std::string, size_t> uses;
+	for (auto& [address, name] : functions)
+	{
+		names.push_back(function_file_name(address, name));
+		uses[key(names.back())]++;
+	}
+
+	size_t index = 0;
+	for (auto& [address, name] : functions)
+	{
+		auto& file_name = names[index++];
+		if (uses[key(file_name)] > 1)
+			file_name += format::str("_%llx", address);
+	}
+	return names;
+}
@@ -0,0 +1,159 @@
+#include "lift_cache.hpp"
+#include "vtil-utils.hpp"
+
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+
+using namespace vtil;
+
+// Immediates this close to the instruction's own address are assumed to be derived from it
+constexpr uint64_t address_dependent_range = 1ull << 32;
+
+lift_cache& lift_cache::instance()
+{
+	static lift_cache cache;
+	return cache;
+}
+
+std::shared_ptr<const lifted_sequence> lift_cache::find(const uint8_t* code, size_t& length) const
+{
+	// Encodings are prefix free, so at most one of the cached lengths can match
+	//
+	uint32_t seen = lengths;
+	std::shared_lock _g(lock);
+	for (length = 1; length <= max_instruction_length; length++)
+	{
+		if (!(seen & (1u << length)))
+			continue;
+		auto it = entries.find(std::string((const char*)code, length));
+		if (it != entries.end())
+			return it->second;
+	}
+	return nullptr;
+}
+
+void lift_cache::replay(basic_block* block, uint64_t vip, const lifted_sequence& sequence) const
+{
+	int64_t sp_offset = block->sp_offset;
+	uint32_t sp_index = block->sp_index;
+
+	// Temporaries get fresh identifiers so each copy of the sequence stays independent
+	//
+	std::unordered_map<uint64_t, uint64_t> temporaries;
+	for (const auto& entry : sequence.instructions)
+	{
+		instruction ins = entry.instruction;
+		ins.vip = vip;
+		for (auto& op : ins.operands)
+		{
+			if (!op.is_register() || !op.reg().is_local())
+				continue;
+
+			auto [it, inserted] = temporaries.emplace(op.reg().combined_id, 0);
+			if (inserted)
+				it->second = block->tmp(64).combined_id;
+
+			register_desc reg = op.reg();
+			reg.combined_id = it->second;
+			op = operand(reg);
+		}
+
+		block->sp_offset = sp_offset + entry.sp_offset;
+		block->sp_index = sp_index + entry.sp_index;
+		block->push_back(ins);
+	}
+
+	block->sp_offset = sp_offset + sequence.sp_offset_delta;
+	block->sp_index = sp_index + sequence.sp_index_delta;
+}
+
+std::shared_ptr<const lifted_sequence> lift_cache::capture(basic_block* block, uint64_t vip, size_t count, int64_t sp_offset, uint32_t sp_index) const
+{
+	auto sequence = std::make_shared<lifted_sequence>();
+	sequence->sp_offset_delta = block->sp_offset - sp_offset;
+	sequence->sp_index_delta = block->sp_index - sp_index;
+
+	auto it = block->end();
+	std::advance(it, -int64_t(count));
+	for (; it != block->end(); ++it)
+	{
+		const instruction& ins = *it;
+		if (ins.base->is_branching())
+			return nullptr;
+
+		for (const auto& op : ins.operands)
+		{
+			if (op.is_immediate() && op.imm().u64 - vip + address_dependent_range < 2 * address_dependent_range)
+				return nullptr;
+		}
+		sequence->instructions.push_back({ ins, ins.sp_offset - sp_offset, ins.sp_index - sp_index });
+	}
+	return sequence;
+}
+
+size_t lift_cache::lift(basic_block* block, uint64_t vip, uint8_t* code, lift_fn fn)
+{
+	if (!enabled)
+		return fn(block, vip, code);
+
+	size_t length;
+	if (auto sequence = find(code, length))
+	{
+		hits++;
+		replay(block, vip, *sequence);
+		return length;
+	}
+	misses++;
+
+	size_t size = block->size();
+	size_t successors = block->next.size();
+	int64_t sp_offset = block->sp_offset;
+	uint32_t sp_index = block->sp_index;
+
+	length = fn(block, vip, code);
+
+	// Only sequences that did nothing but append instructions can be replayed
+	//
+	if (length == 0 || length > max_instruction_length || block->size() < size || block->next.size() != successors)
+	{
+		uncacheable++;
+		return length;
+	}
+	auto sequence = capture(block, vip, block->size() - size, sp_offset, sp_index);
+	if (!sequence)
+	{
+		uncacheable++;
+		return length;
+	}
+
+	std::unique_lock _g(lock);
+	if (entries.size() < max_entries)
+	{
+		entries.emplace(std::string((const char*)code, length), std::move(sequence));
+		lengths |= 1u << length;
+	}
+	return length;
+}
+
+void lift_cache::clear()
+{
+	std::unique_lock _g(lock);
+	entries.clear();
+	lengths = 0;
+	hits = 0;
+	misses = 0;
+	uncacheable = 0;
+}
+
+void lift_cache::report() const
+{
+	size_t lookups = hits + misses;
+	size_t cached;
+	{
+		std::shared_lock _g(lock);
+		cached = entries.size();
+	}
+	log_at(verbosity_level::normal, "[*] Lift cache: %llu hits, %llu misses (%.1f%% reused), %llu uncacheable, %llu distinct instructions\n",
+		hits.load(), misses.load(), lookups ? 100.0 * hits / lookups : 0.0, uncacheable.load(), cached);
+}
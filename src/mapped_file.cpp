@@ -0,0 +1,122 @@
+#include "mapped_file.hpp"
+#include "vtil-utils.hpp"
+
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file::mapped_file(const std::filesystem::path& path)
+{
+#ifdef _WIN32
+	auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		fatal("Could not open file '%s'", path.string());
+	file_handle = file;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size))
+	{
+		close();
+		fatal("Could not query the size of '%s'", path.string());
+	}
+
+	// Empty files cannot be mapped, they are represented by an empty view
+	if (file_size.QuadPart == 0)
+		return;
+
+	mapping_handle = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping_handle)
+	{
+		close();
+		fatal("Could not map file '%s'", path.string());
+	}
+
+	base = (const uint8_t*)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	if (!base)
+	{
+		close();
+		fatal("Could not map file '%s'", path.string());
+	}
+	length = (size_t)file_size.QuadPart;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		fatal("Could not open file '%s'", path.string());
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		fatal("Could not query the size of '%s'", path.string());
+	}
+
+	// Empty files cannot be mapped, they are represented by an empty view
+	if (st.st_size != 0)
+	{
+		void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view == MAP_FAILED)
+		{
+			::close(fd);
+			fatal("Could not map file '%s'", path.string());
+		}
+		base = (const uint8_t*)view;
+		length = (size_t)st.st_size;
+	}
+
+	// The mapping keeps its own reference to the file
+	::close(fd);
+#endif
+}
+
+mapped_file::~mapped_file()
+{
+	close();
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept
+{
+	*this = std::move(other);
+}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept
+{
+	if (this != &other)
+	{
+		close();
+		std::swap(base, other.base);
+		std::swap(length, other.length);
+#ifdef _WIN32
+		std::swap(file_handle, other.file_handle);
+		std::swap(mapping_handle, other.mapping_handle);
+#endif
+	}
+	return *this;
+}
+
+void mapped_file::close()
+{
+#ifdef _WIN32
+	if (base)
+		UnmapViewOfFile(base);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+#else
+	if (base)
+		munmap((void*)base, length);
+#endif
+	base = nullptr;
+	length = 0;
+}
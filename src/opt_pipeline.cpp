@@ -0,0 +1,317 @@
+#include "opt_pipeline.hpp"
+#include "vtil-utils.hpp"
+
+#include <vtil/compiler>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+
+using namespace vtil;
+
+template<typename T>
+static size_t run_pass(routine* rtn)
+{
+	return T{}.xpass(rtn);
+}
+
+const std::vector<opt_pass>& opt_passes()
+{
+	static const std::vector<opt_pass> passes = {
+		{ "stack_pinning", &run_pass<optimizer::stack_pinning_pass> },
+		{ "istack_ref_substitution", &run_pass<optimizer::istack_ref_substitution_pass> },
+		{ "bblock_extension", &run_pass<optimizer::bblock_extension_pass> },
+		{ "stack_propagation", &run_pass<optimizer::stack_propagation_pass> },
+		{ "dead_code_elimination", &run_pass<optimizer::dead_code_elimination_pass> },
+		{ "fast_dead_code_elimination", &run_pass<optimizer::fast_dead_code_elimination_pass> },
+		{ "mov_propagation", &run_pass<optimizer::mov_propagation_pass> },
+		{ "register_renaming", &run_pass<optimizer::register_renaming_pass> },
+		{ "symbolic_rewrite", &run_pass<optimizer::symbolic_rewrite_pass<false>> },
+		{ "symbolic_rewrite_force", &run_pass<optimizer::symbolic_rewrite_pass<true>> },
+		{ "branch_correction", &run_pass<optimizer::branch_correction_pass> },
+	};
+	return passes;
+}
+
+const opt_pass* find_opt_pass(const std::string& name)
+{
+	for (const auto& pass : opt_passes())
+	{
+		if (name == pass.name)
+			return &pass;
+	}
+	return nullptr;
+}
+
+const opt_pipeline& default_pipeline()
+{
+	static const opt_pipeline pipeline = [] {
+		auto step = [](std::initializer_list<const char*> names, bool exhaust) {
+			opt_step result;
+			result.exhaust = exhaust;
+			for (auto name : names)
+				result.passes.push_back(find_opt_pass(name));
+			return result;
+		};
+
+		return opt_pipeline{
+			step({ "stack_pinning", "istack_ref_substitution", "bblock_extension", "stack_propagation",
+				"dead_code_elimination", "fast_dead_code_elimination", "mov_propagation", "register_renaming",
+				"fast_dead_code_elimination", "symbolic_rewrite_force" }, false),
+			step({ "stack_propagation", "mov_propagation", "fast_dead_code_elimination", "register_renaming",
+				"fast_dead_code_elimination" }, true),
+			step({ "symbolic_rewrite", "branch_correction", "bblock_extension" }, false),
+		};
+	}();
+	return pipeline;
+}
+
+const opt_pipeline& preset_pipeline(int level)
+{
+	static const opt_pipeline none;
+	static const opt_pipeline cheap = parse_pipeline(
+		"stack_pinning,istack_ref_substitution,bblock_extension,stack_propagation,mov_propagation,fast_dead_code_elimination,branch_correction");
+
+	switch (level)
+	{
+	case 0: return none;
+	case 1: return cheap;
+	case 2: return default_pipeline();
+	default: fatal("Unknown optimization level %d", level);
+	}
+	unreachable();
+}
+
+opt_pipeline parse_pipeline(const std::string& spec)
+{
+	opt_pipeline pipeline;
+	bool in_group = false;
+
+	size_t pos = 0;
+	while (pos <= spec.size())
+	{
+		size_t end = spec.find_first_of(",[]", pos);
+		if (end == std::string::npos)
+			end = spec.size();
+
+		// Trim whitespace around the pass name
+		//
+		std::string name = spec.substr(pos, end - pos);
+		name.erase(0, name.find_first_not_of(" \t"));
+		name.erase(name.find_last_not_of(" \t") + 1);
+
+		if (!name.empty())
+		{
+			auto pass = find_opt_pass(name);
+			if (!pass)
+			{
+				std::string known;
+				for (const auto& p : opt_passes())
+					known += (known.empty() ? "" : ", ") + std::string(p.name);
+				fatal("Unknown optimizer pass '%s', expected one of: %s", name, known);
+			}
+
+			if (!in_group && (pipeline.empty() || pipeline.back().exhaust))
+				pipeline.emplace_back();
+			pipeline.back().passes.push_back(pass);
+		}
+
+		if (end == spec.size())
+			break;
+
+		if (spec[end] == '[')
+		{
+			if (in_group)
+				fatal("Nested pass groups are not supported in '%s'", spec);
+			in_group = true;
+			pipeline.emplace_back().exhaust = true;
+		}
+		else if (spec[end] == ']')
+		{
+			if (!in_group)
+				fatal("Unbalanced ']' in '%s'", spec);
+			in_group = false;
+		}
+		pos = end + 1;
+	}
+
+	if (in_group)
+		fatal("Unbalanced '[' in '%s'", spec);
+	return pipeline;
+}
+
+std::string describe_pipeline(const opt_pipeline& pipeline)
+{
+	std::string spec;
+	for (const auto& step : pipeline)
+	{
+		std::string passes;
+		for (auto pass : step.passes)
+			passes += (passes.empty() ? "" : ",") + std::string(pass->name);
+		if (step.exhaust)
+			passes = "[" + passes + "]";
+		spec += (spec.empty() ? "" : ",") + passes;
+	}
+	return spec;
+}
+
+bool run_pipeline(routine* rtn, const opt_pipeline& pipeline, const opt_budget& budget, routine_profile* profile)
+{
+	using clock = std::chrono::steady_clock;
+	auto elapsed = [](clock::time_point since) {
+		return std::chrono::duration<double, std::milli>(clock::now() - since).count();
+	};
+
+	// Passes appearing several times in the pipeline are accumulated into a single entry
+	//
+	std::map<std::string, size_t> slots;
+	auto slot = [&](const opt_pass* pass) -> pass_profile& {
+		auto [it, inserted] = slots.emplace(pass->name, profile->passes.size());
+		if (inserted)
+		{
+			auto& entry = profile->passes.emplace_back();
+			entry.pass = pass->name;
+			entry.instructions_before = rtn->num_instructions();
+			entry.blocks_before = rtn->num_blocks();
+		}
+		return profile->passes[it->second];
+	};
+
+	if (profile)
+	{
+		profile->instructions_before = rtn->num_instructions();
+		profile->blocks_before = rtn->num_blocks();
+	}
+
+	// Passes that overran their budget are not scheduled again
+	//
+	std::set<const opt_pass*> dropped;
+	bool stopped = false;
+
+	auto start = clock::now();
+	for (const auto& step : pipeline)
+	{
+		size_t changes;
+		do
+		{
+			changes = 0;
+			for (auto pass : step.passes)
+			{
+				if (stopped)
+					break;
+				if (dropped.count(pass))
+					continue;
+
+				pass_profile* entry = profile ? &slot(pass) : nullptr;
+
+				auto t0 = clock::now();
+				size_t n = pass->run(rtn);
+				double milliseconds = elapsed(t0);
+				changes += n;
+
+				bool pass_overrun = budget.pass_milliseconds > 0 && milliseconds > budget.pass_milliseconds;
+				if (pass_overrun)
+					dropped.insert(pass);
+				if (budget.routine_milliseconds > 0 && elapsed(start) > budget.routine_milliseconds)
+					stopped = true;
+
+				if (entry)
+				{
+					entry->iterations++;
+					entry->changes += n;
+					entry->milliseconds += milliseconds;
+					entry->instructions_after = rtn->num_instructions();
+					entry->blocks_after = rtn->num_blocks();
+					entry->budget_exceeded |= pass_overrun;
+				}
+			}
+		} while (step.exhaust && changes && !stopped);
+
+		if (stopped)
+			break;
+	}
+
+	bool completed = !stopped && dropped.empty();
+	if (profile)
+	{
+		profile->milliseconds = elapsed(start);
+		profile->instructions_after = rtn->num_instructions();
+		profile->blocks_after = rtn->num_blocks();
+		profile->budget_exceeded = !completed;
+	}
+	return completed;
+}
+
+json::value profile_report(const std::vector<routine_profile>& profiles)
+{
+	struct pass_total
+	{
+		size_t routines = 0;
+		size_t iterations = 0;
+		size_t changes = 0;
+		double milliseconds = 0;
+	};
+	std::map<std::string, pass_total> totals;
+
+	json::value report = json::value::object();
+	auto& routines = report["routines"] = json::value::array();
+	double total_milliseconds = 0;
+	for (const auto& profile : profiles)
+	{
+		json::value entry = json::value::object();
+		entry["routine"] = profile.routine;
+		entry["milliseconds"] = profile.milliseconds;
+		entry["instructions_before"] = uint64_t(profile.instructions_before);
+		entry["instructions_after"] = uint64_t(profile.instructions_after);
+		entry["blocks_before"] = uint64_t(profile.blocks_before);
+		entry["blocks_after"] = uint64_t(profile.blocks_after);
+		entry["budget_exceeded"] = profile.budget_exceeded;
+
+		auto& passes = entry["passes"] = json::value::array();
+		for (const auto& pass : profile.passes)
+		{
+			json::value p = json::value::object();
+			p["pass"] = pass.pass;
+			p["iterations"] = uint64_t(pass.iterations);
+			p["changes"] = uint64_t(pass.changes);
+			p["milliseconds"] = pass.milliseconds;
+			p["instructions_before"] = uint64_t(pass.instructions_before);
+			p["instructions_after"] = uint64_t(pass.instructions_after);
+			p["blocks_before"] = uint64_t(pass.blocks_before);
+			p["blocks_after"] = uint64_t(pass.blocks_after);
+			p["budget_exceeded"] = pass.budget_exceeded;
+			passes.push_back(std::move(p));
+
+			auto& total = totals[pass.pass];
+			total.routines++;
+			total.iterations += pass.iterations;
+			total.changes += pass.changes;
+			total.milliseconds += pass.milliseconds;
+		}
+		total_milliseconds += profile.milliseconds;
+		routines.push_back(std::move(entry));
+	}
+
+	// Per pass totals, the most expensive pass first
+	//
+	std::vector<std::pair<std::string, pass_total>> sorted(totals.begin(), totals.end());
+	std::stable_sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+		return a.second.milliseconds > b.second.milliseconds;
+	});
+
+	auto& passes = report["passes"] = json::value::array();
+	for (const auto& [name, total] : sorted)
+	{
+		json::value p = json::value::object();
+		p["pass"] = name;
+		p["routines"] = uint64_t(total.routines);
+		p["iterations"] = uint64_t(total.iterations);
+		p["changes"] = uint64_t(total.changes);
+		p["milliseconds"] = total.milliseconds;
+		p["share"] = total_milliseconds > 0 ? total.milliseconds / total_milliseconds : 0.0;
+		passes.push_back(std::move(p));
+	}
+	report["milliseconds"] = total_milliseconds;
+	return report;
+}
@@ -1,7 +1,32 @@
 #include "vtil-utils.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#endif
+
 namespace fs = std::filesystem;
 
+verbosity_level verbosity = verbosity_level::normal;
+
 args::Group& commands()
 {
 	static args::Group instance("Commands");
@@ -32,6 +57,183 @@ std::vector<std::filesystem::path> enum_vtil_files(const std::filesystem::path&
 	return files;
 }
 
+std::vector<std::filesystem::path> read_list_file(const std::filesystem::path& path)
+{
+	std::ifstream stream(path);
+	if (!stream.is_open())
+		fatal("Could not open list file '%s'", path.string());
+
+	std::vector<fs::path> files;
+	std::string line;
+	while (std::getline(stream, line))
+	{
+		while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+			line.pop_back();
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		fs::path p = line;
+		if (p.is_relative())
+			p = path.parent_path() / p;
+		files.push_back(p);
+	}
+	return files;
+}
+
+std::filesystem::path batch_relative_path(const std::filesystem::path& file, const std::filesystem::path& root)
+{
+	auto relative = file.lexically_normal().lexically_relative(root.lexically_normal());
+	if (relative.empty() || *relative.begin() == "..")
+		return file.filename();
+	return relative;
+}
+
+void disambiguate_paths(std::vector<std::filesystem::path>& paths)
+{
+	auto key = [](const fs::path& path) {
+		std::string text = path.generic_string();
+		std::transform(text.begin(), text.end(), text.begin(), [](char c) { return char(tolower((uint8_t)c)); });
+		return text;
+	};
+
+	std::unordered_set<std::string> taken;
+	for (const auto& path : paths)
+		taken.insert(key(path));
+
+	std::unordered_set<std::string> seen;
+	for (auto& path : paths)
+	{
+		if (seen.insert(key(path)).second)
+			continue;
+
+		fs::path candidate;
+		for (size_t n = 2;; n++)
+		{
+			candidate = path.parent_path() / (path.stem().string() + "_" + std::to_string(n) + path.extension().string());
+			if (!taken.count(key(candidate)))
+				break;
+		}
+		taken.insert(key(candidate));
+		seen.insert(key(candidate));
+		path = candidate;
+	}
+}
+
+std::vector<std::filesystem::path> batch_relative_paths(const std::vector<std::filesystem::path>& files, const std::filesystem::path& root)
+{
+	std::vector<fs::path> paths;
+	for (const auto& file : files)
+		paths.push_back(batch_relative_path(file, root));
+	disambiguate_paths(paths);
+	return paths;
+}
+
+std::vector<uint8_t> read_file_bytes(const std::filesystem::path& path)
+{
+	std::ifstream stream(path, std::ios::binary);
+	if (!stream.is_open())
+		fatal("Could not open file '%s'", path.string());
+	return { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+}
+
+void write_file_bytes(const std::filesystem::path& path, const std::vector<uint8_t>& data)
+{
+	std::ofstream stream(path, std::ios::binary);
+	if (!stream.is_open())
+		fatal("Could not write file '%s'", path.string());
+	stream.write((const char*)data.data(), data.size());
+}
+
+uint64_t peak_memory_bytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return uint64_t(usage.ru_maxrss);
+#else
+	return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+uint64_t current_memory_bytes()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.WorkingSetSize;
+#elif defined(__APPLE__)
+	mach_task_basic_info_data_t info;
+	mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+	if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+		return 0;
+	return info.resident_size;
+#else
+	// The second field of statm is the resident set in pages
+	//
+	std::ifstream statm("/proc/self/statm");
+	uint64_t size = 0, resident = 0;
+	if (!(statm >> size >> resident))
+		return 0;
+	return resident * uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+size_t default_jobs()
+{
+	return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+void parallel_for(size_t count, size_t jobs, const std::function<void(size_t)>& fn)
+{
+	jobs = std::clamp<size_t>(jobs, 1, std::max<size_t>(count, 1));
+	if (jobs == 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			fn(i);
+		return;
+	}
+
+	std::atomic<size_t> next = 0;
+	std::exception_ptr error;
+	std::mutex error_lock;
+
+	auto worker = [&]() {
+		for (size_t i; (i = next++) < count;)
+		{
+			try
+			{
+				fn(i);
+			}
+			catch (...)
+			{
+				// Keep the first error, stop handing out new work
+				std::lock_guard _g(error_lock);
+				if (!error)
+					error = std::current_exception();
+				next = count;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < jobs; i++)
+		threads.emplace_back(worker);
+	for (auto& thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
 using namespace vtil::logger;
 
 int main(int argc, const char** argv)
@@ -42,6 +244,13 @@ int main(int argc, const char** argv)
 
 	args::Group arguments("Arguments");
 	args::HelpFlag help(arguments, "help", "Display this help menu", { 'h', "help" });
+	args::ActionFlag quiet(arguments, "quiet", "Only print errors", { 'q', "quiet" }, []() {
+		verbosity = verbosity_level::quiet;
+	});
+	args::ActionFlag verbose(arguments, "verbose", "Print more details, repeat (-vv) for compiler traces", { 'v', "verbose" }, []() {
+		if (verbosity < verbosity_level::trace)
+			verbosity = verbosity_level(int(verbosity) + 1);
+	});
 	args::GlobalOptions globals(parser, arguments);
 
 	auto showHelp = [&parser]() {
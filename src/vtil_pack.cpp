@@ -0,0 +1,211 @@
+#include "vtil_pack.hpp"
+#include "vtil-utils.hpp"
+#include "artifact_cache.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <istream>
+
+namespace fs = std::filesystem;
+
+constexpr size_t pack_header_size = 32;
+constexpr size_t pack_entry_fixed_size = 8 + 8 + 4 + 4 + 32 + 2;
+
+// Streambuf over memory that is not owned, lets the stream based deserializer read from the mapping
+struct memory_streambuf : std::streambuf
+{
+	memory_streambuf(const uint8_t* data, size_t size)
+	{
+		auto begin = (char*)data;
+		setg(begin, begin, begin + size);
+	}
+};
+
+template<typename T>
+static T read_le(const uint8_t* p)
+{
+	T value = 0;
+	for (size_t i = 0; i < sizeof(T); i++)
+		value |= T(p[i]) << (i * 8);
+	return value;
+}
+
+template<typename T>
+static void write_le(std::string& out, T value)
+{
+	for (size_t i = 0; i < sizeof(T); i++)
+		out += char(uint8_t(value >> (i * 8)));
+}
+
+static std::string hex_to_bytes(const std::string& hex)
+{
+	std::string bytes;
+	for (size_t i = 0; i + 1 < hex.size(); i += 2)
+		bytes += char(std::stoul(hex.substr(i, 2), nullptr, 16));
+	return bytes;
+}
+
+vtil_pack::vtil_pack(const fs::path& path)
+	: file(path)
+{
+	auto base = file.data();
+	auto size = file.size();
+	if (size < pack_header_size || memcmp(base, vtil_pack_magic, sizeof(vtil_pack_magic)) != 0)
+		fatal("'%s' is not a .vtilpack file", path.string());
+	if (auto version = read_le<uint32_t>(base + 8); version != vtil_pack_version)
+		fatal("'%s' has unsupported pack version %u", path.string(), version);
+
+	auto count = read_le<uint32_t>(base + 12);
+	auto index_offset = read_le<uint64_t>(base + 16);
+	auto index_size = read_le<uint64_t>(base + 24);
+	if (index_offset > size || index_size > size - index_offset)
+		fatal("'%s' has a truncated index", path.string());
+
+	auto p = base + index_offset;
+	auto end = p + index_size;
+	index.reserve(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (size_t(end - p) < pack_entry_fixed_size)
+			fatal("'%s' has a truncated index", path.string());
+
+		pack_entry entry;
+		entry.offset = read_le<uint64_t>(p);
+		entry.size = read_le<uint64_t>(p + 8);
+		entry.blocks = read_le<uint32_t>(p + 16);
+		entry.instructions = read_le<uint32_t>(p + 20);
+		for (size_t j = 0; j < 32; j++)
+		{
+			entry.hash += "0123456789abcdef"[p[24 + j] >> 4];
+			entry.hash += "0123456789abcdef"[p[24 + j] & 0xF];
+		}
+		auto name_length = read_le<uint16_t>(p + 56);
+		p += pack_entry_fixed_size;
+
+		if (size_t(end - p) < name_length || entry.offset > size || entry.size > size - entry.offset)
+			fatal("'%s' has a corrupt index entry", path.string());
+		entry.name.assign((const char*)p, name_length);
+		p += name_length;
+
+		by_name.emplace(entry.name, index.size());
+		index.push_back(std::move(entry));
+	}
+}
+
+const pack_entry* vtil_pack::find(const std::string& name) const
+{
+	auto it = by_name.find(name);
+	return it != by_name.end() ? &index[it->second] : nullptr;
+}
+
+vtil::routine* vtil_pack::load(const pack_entry& entry) const
+{
+	return deserialize_routine(data(entry), entry.size);
+}
+
+void write_pack(const fs::path& path, const std::vector<pack_source>& routines)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out.is_open())
+		fatal("Could not write pack '%s'", path.string());
+
+	// The header is written last, once the index location is known
+	//
+	out.write(std::string(pack_header_size, '\0').data(), pack_header_size);
+
+	std::string index;
+	uint64_t offset = pack_header_size;
+	for (const auto& routine : routines)
+	{
+		if (routine.name.size() > UINT16_MAX)
+			fatal("Routine name '%s' is too long", routine.name);
+
+		out.write((const char*)routine.data.data(), routine.data.size());
+
+		write_le<uint64_t>(index, offset);
+		write_le<uint64_t>(index, routine.data.size());
+		write_le<uint32_t>(index, routine.blocks);
+		write_le<uint32_t>(index, routine.instructions);
+		index += hex_to_bytes(sha256{}.update(routine.data.data(), routine.data.size()).hex_digest());
+		write_le<uint16_t>(index, uint16_t(routine.name.size()));
+		index += routine.name;
+		offset += routine.data.size();
+	}
+	out.write(index.data(), index.size());
+
+	std::string header(vtil_pack_magic, sizeof(vtil_pack_magic));
+	write_le<uint32_t>(header, vtil_pack_version);
+	write_le<uint32_t>(header, uint32_t(routines.size()));
+	write_le<uint64_t>(header, offset);
+	write_le<uint64_t>(header, index.size());
+	out.seekp(0);
+	out.write(header.data(), header.size());
+
+	if (!out.good())
+		fatal("Could not write pack '%s'", path.string());
+}
+
+vtil::routine* deserialize_routine(const uint8_t* data, size_t size)
+{
+	memory_streambuf buffer(data, size);
+	std::istream stream(&buffer);
+
+	vtil::routine* rtn = nullptr;
+	vtil::deserialize(stream, rtn);
+	return rtn;
+}
+
+std::string routine_ref::stem() const
+{
+	if (!in_pack())
+		return file.stem().string();
+
+	// Pack names may contain directories, keep only the last component
+	//
+	auto slash = name.find_last_of("/\\");
+	return slash == std::string::npos ? name : name.substr(slash + 1);
+}
+
+routine_ref parse_routine_ref(const std::string& spec)
+{
+	// Split on the separator following the extension so drive letters are left alone
+	//
+	std::string separator = std::string(vtil_pack_extension) + ":";
+	auto pos = spec.rfind(separator);
+	if (pos == std::string::npos)
+		return { spec, "" };
+
+	auto name = spec.substr(pos + separator.size());
+	if (name.empty())
+		fatal("Missing routine name in '%s'", spec);
+	return { spec.substr(0, pos + strlen(vtil_pack_extension)), name };
+}
+
+// Looks up a routine in its pack, the pack stays mapped only for the duration of the call
+template<typename F>
+static auto with_pack_entry(const routine_ref& ref, F&& fn)
+{
+	vtil_pack pack(ref.file);
+	auto entry = pack.find(ref.name);
+	if (!entry)
+		fatal("No routine named '%s' in '%s'", ref.name, ref.file.string());
+	return fn(pack, *entry);
+}
+
+vtil::routine* load_routine_ref(const routine_ref& ref)
+{
+	if (!ref.in_pack())
+		return vtil::load_routine(ref.file);
+	return with_pack_entry(ref, [](const vtil_pack& pack, const pack_entry& entry) {
+		return pack.load(entry);
+	});
+}
+
+std::vector<uint8_t> read_routine_bytes(const routine_ref& ref)
+{
+	if (!ref.in_pack())
+		return read_file_bytes(ref.file);
+	return with_pack_entry(ref, [](const vtil_pack& pack, const pack_entry& entry) {
+		return std::vector<uint8_t>(pack.data(entry), pack.data(entry) + entry.size);
+	});
+}